@@ -1,11 +1,17 @@
-
 #pragma once
 
 #include "constants.hpp"
 #include "package.hpp"
 #include "error.hpp"
 #include "result.hpp"
+#include "types.hpp"
 #include <sqlite3.h>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 #include <string>
 
@@ -14,14 +20,163 @@ namespace gdpm::cache {
 	struct params {
 		string cache_path	= GDPM_PACKAGE_CACHE_PATH;
 		string table_name	= GDPM_PACKAGE_CACHE_TABLENAME;
+		int busy_timeout	= GDPM_PACKAGE_CACHE_BUSY_TIMEOUT_MS;
+		size_t max_readers	= GDPM_PACKAGE_CACHE_MAX_READERS;
+	};
+
+	/*!
+	@brief Owns a single SQLite connection to the package cache for the
+	lifetime of the process. Prepared statements are cached by their SQL text
+	so each query shape is only parsed once per connection.
+
+	The writable connection puts the cache in WAL mode so that other gdpm
+	processes and the read-only connections handed out by `acquire_reader()`
+	can keep reading while a sync is writing. Readers are returned to the pool
+	when the last copy of the handle is released, so they must not outlive
+	the database that created them.
+	*/
+	class database : public non_copyable{
+	public:
+		database(const string& path = GDPM_PACKAGE_CACHE_PATH, bool read_only = false);
+		~database();
+
+		error open();
+		void close();
+		bool is_open() const;
+		bool is_read_only() const;
+		error exec(const string& sql);
+		result_t<sqlite3_stmt*> prepare(const string& sql);
+		error begin();
+		error commit();
+		error rollback();
+		result_t<std::shared_ptr<database>> acquire_reader();
+		void set_busy_timeout(int ms);
+		void set_max_readers(size_t count);
+		sqlite3* get_handle() const;
+		const string& get_path() const;
+		std::recursive_mutex& get_mutex();
+
+	private:
+		/* Readers only hold the pool weakly, so one that is released after
+		its database is gone is closed instead of pooled. */
+		struct reader_pool{
+			std::vector<ptr<database>> idle;
+			size_t count				= 0;
+			size_t max_count			= GDPM_PACKAGE_CACHE_MAX_READERS;
+			std::mutex mutex;
+			std::condition_variable cv;
+		};
+		static void _release_reader(const std::weak_ptr<reader_pool>& pool, database *reader);
+
+		sqlite3 *db = nullptr;
+		string path;
+		bool read_only					= false;
+		int busy_timeout				= GDPM_PACKAGE_CACHE_BUSY_TIMEOUT_MS;
+		std::unordered_map<string, sqlite3_stmt*> statements;
+		std::recursive_mutex mutex;
+		std::shared_ptr<reader_pool> readers = std::make_shared<reader_pool>();
+	};
+
+	/*!
+	@brief Summary of a bulk insert into the package cache. `changed` counts
+	the rows that were actually written, so it stays 0 for staged rows until
+	`swap_staged_packages()` reports them.
+	*/
+	struct insert_stats{
+		size_t rows		= 0;
+		size_t changed	= 0;
+		double seconds	= 0.0;
+
+		double rows_per_second() const { return (seconds > 0.0) ? rows / seconds : 0.0; }
 	};
 
+	/*!
+	@brief Summary of swapping staged packages into the cache.
+	*/
+	struct swap_stats{
+		size_t rows		= 0;
+		size_t changed	= 0;
+		size_t removed	= 0;
+		double seconds	= 0.0;
+	};
+
+	/*!
+	@brief What is known about the last sync with a remote. The newest
+	`modify_date` seen is used as a high-water mark for delta syncs and
+	`last_synced` (seconds since epoch) to tell if the cache is still fresh.
+	The checkpoint records the last page staged by an unfinished full sync
+	and the query it was made with, so the sync can be resumed.
+	*/
+	struct sync_checkpoint{
+		string query;
+		int page					= -1;
+		int total_items				= 0;
+		string newest_modify_date;
+
+		bool is_set() const { return page >= 0; }
+	};
+
+	struct sync_state{
+		string remote_source;
+		string newest_modify_date;
+		std::int64_t last_synced	= 0;
+		sync_checkpoint checkpoint;
+	};
+
+	/*!
+	@brief A schema change for the package cache. `sql` receives the table
+	name so the same migration can be applied to any cache table.
+	*/
+	struct migration{
+		int version;
+		string description;
+		std::function<string(const string& table_name)> sql;
+	};
+
+	database& get_database(const params& = params());
+	void close_databases();
+
+	/*!
+	@brief Opens the package cache with the busy timeout and reader pool size
+	from `params` and brings its schema up to date.
+	*/
+	error initialize(const params& = params());
+	error migrate(const params& = params());
+	result_t<int> get_schema_version(const params& = params());
 	bool exists(const params& = params());
 	error create_package_database(bool overwrite = false, const params& = params());
 	error insert_package_info(const package::info_list& packages, const params& = params());
+	result_t<insert_stats> bulk_insert_package_info(const package::info_list& packages, const params& = params());
+	/*!
+	@brief Looks up all packages matching the given ids or titles in a single
+	query. Results are in input order, missing and duplicate keys omitted.
+	*/
 	result_t<package::info_list> get_package_info_by_id(const package::id_list& package_ids, const params& = params());
 	result_t<package::info_list> get_package_info_by_title(const package::title_list& package_titles, const params& params = cache::params());
+	/*!
+	@brief Ranked full-text search over the title, author, description and
+	category of cached packages. Every word in `text` is matched as a prefix.
+	An empty `text` returns the most recently updated packages instead.
+	*/
+	result_t<package::info_list> search_package_info(const string& text, int max_results = 0, const params& = params());
 	result_t<package::info_list> get_installed_packages(const params& = params());
+	/*!
+	@brief Inserts or updates packages keyed by (remote_source, asset_id)
+	without touching their local install state.
+	*/
+	result_t<insert_stats> upsert_package_info(const package::info_list& packages, const params& = params());
+	/*!
+	@brief Full syncs write into a staging table first, then swap it into
+	the cache in a single transaction. The swap upserts every staged row and
+	deletes uninstalled packages from `remote_source` that weren't staged.
+	It is refused when fewer than `expected_rows` rows were staged, since the
+	packages on the missing pages would be deleted.
+	*/
+	error clear_staged_packages(const string& remote_source, const params& = params());
+	result_t<insert_stats> stage_package_info(const package::info_list& packages, const params& = params());
+	result_t<swap_stats> swap_staged_packages(const string& remote_source, size_t expected_rows = 0, const params& = params());
+	result_t<sync_state> get_sync_state(const string& remote_source, const params& = params());
+	error set_sync_state(const sync_state& state, const params& = params());
 	error update_package_info(const package::info_list& packages, const params& = params());
 	error update_sync_info(const args_t& download_urls, const params& = params());
 	error delete_packages(const package::title_list& package_titles, const params& = params());
@@ -30,4 +185,4 @@ namespace gdpm::cache {
 
 	result_t<string> to_values(const package::info& package);
 	result_t<string> to_values(const package::info_list& packages);
-}
\ No newline at end of file
+}
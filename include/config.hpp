@@ -26,9 +26,14 @@ namespace gdpm::config{
 		string packages_dir;
 		string tmp_dir;
 		string_map remote_sources;
-		int jobs					= 1;
+		int jobs					= GDPM_CONFIG_THREADS;
 		int timeout					= 3000;
+		int busy_timeout			= GDPM_CONFIG_BUSY_TIMEOUT_MS;
+		int sync_ttl				= GDPM_CONFIG_SYNC_TTL_S;
+		int max_host_streams		= GDPM_CONFIG_MAX_HOST_STREAMS;
+		int max_host_rate			= GDPM_CONFIG_MAX_HOST_RATE;
 		bool enable_sync			= true;
+		bool force_sync				= false;
 		bool enable_cache			= true;
 		bool skip_prompt			= false;
 		bool ignore_validation 		= false;
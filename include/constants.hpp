@@ -34,8 +34,13 @@ namespace gdpm::print{
 #define GDPM_CONFIG_LOCAL_PACKAGES_DIR gdpm::constants::LocalPackagesDir
 #define GDPM_CONFIG_LOCAL_TMP_DIR gdpm::constants::TemporaryPath
 #define GDPM_CONFIG_REMOTE_SOURCES std::pair<std::string, std::string>(constants::RemoteName, constants::HostUrl)
-#define GDPM_CONFIG_THREADS 1
+#define GDPM_CONFIG_THREADS GDPM_CONFIG_SYNC_JOBS
 #define GDPM_CONFIG_TIMEOUT_MS 30000
+#define GDPM_CONFIG_BUSY_TIMEOUT_MS GDPM_PACKAGE_CACHE_BUSY_TIMEOUT_MS
+#define GDPM_CONFIG_SYNC_TTL_S 3600
+#define GDPM_CONFIG_SYNC_JOBS 4
+#define GDPM_CONFIG_MAX_HOST_STREAMS 100
+#define GDPM_CONFIG_MAX_HOST_RATE 0
 #define GDPM_CONFIG_ENABLE_SYNC true
 #define GDPM_CONFIG_ENABLE_FILE_LOGGING true
 #define GDPM_CONFIG_VERBOSE 0
@@ -44,8 +49,35 @@ namespace gdpm::print{
 #define GDPM_PACKAGE_CACHE_ENABLE 1
 #define GDPM_PACKAGE_CACHE_PATH gdpm::constants::LocalPackagesDir + "/packages.db"
 #define GDPM_PACKAGE_CACHE_TABLENAME "cache"
+#define GDPM_PACKAGE_CACHE_SCHEMA_TABLENAME "schema_version"
+#define GDPM_PACKAGE_CACHE_BUSY_TIMEOUT_MS 5000
+#define GDPM_PACKAGE_CACHE_MAX_READERS 4
 #define GDPM_PACKAGE_CACHE_COLNAMES "asset_id, type, title, author, author_id, version, godot_version, cost, description, modify_date, support_level, category, remote_source, download_url, download_hash, is_installed, install_path"
 
+/* Defines the default on-disk cache for HTTP responses */
+#define GDPM_HTTP_CACHE_PATH gdpm::constants::LocalPackagesDir + "/http-cache"
+#define GDPM_HTTP_CACHE_MAX_SIZE (64 * 1024 * 1024)
+
+/* Defines how single large downloads are split into parallel ranges */
+#define GDPM_HTTP_MAX_SEGMENTS 4
+#define GDPM_HTTP_MIN_SEGMENT_SIZE (8 * 1024 * 1024)
+#define GDPM_HTTP_SEGMENT_SAVE_INTERVAL (1024 * 1024)
+
+/* Defines how long to back off when a server answers with 429 or 503 */
+#define GDPM_HTTP_MAX_THROTTLED_RETRIES 5
+#define GDPM_HTTP_MAX_RETRY_AFTER_S 120
+
+/* Defines the default retry policy for failed requests */
+#define GDPM_HTTP_RETRY_MAX_ATTEMPTS 3
+#define GDPM_HTTP_RETRY_BASE_DELAY_MS 250
+#define GDPM_HTTP_RETRY_MAX_DELAY_MS 8000
+#define GDPM_HTTP_LATENCY_SAMPLES 128
+#define GDPM_HTTP_HEDGE_MIN_SAMPLES 20
+
+/* Defines how many response buffers a context keeps for reuse */
+#define GDPM_HTTP_BUFFER_POOL_SIZE 8
+#define GDPM_HTTP_BUFFER_MAX_SIZE (16 * 1024 * 1024)
+
 /* Define macros to set default assets API params */
 #define GDPM_DEFAULT_ASSET_TYPE any
 #define GDPM_DEFAULT_ASSET_CATEGORY 0
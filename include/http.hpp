@@ -1,14 +1,31 @@
 #pragma once
 
 #include "constants.hpp"
+#include "error.hpp"
 #include "types.hpp"
 #include "indicators/indeterminate_progress_bar.hpp"
 #include "indicators/dynamic_progress.hpp"
 #include "indicators/progress_bar.hpp"
 #include "indicators/block_progress_bar.hpp"
 #include "utils.hpp"
+#include "task.hpp"
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <curl/curl.h>
 #include <curl/easy.h>
 
@@ -95,19 +112,71 @@ namespace gdpm::http{
 		DOWNLOAD
 	};
 
+	/*!
+	@brief The status code, headers and body of a finished request. Header
+	names are stored in lower case since HTTP treats them case-insensitively.
+	When a cached body was revalidated by the server, `from_cache` is set and
+	the code is reported as OK with the body read from disk.
+
+	`bytes_received` is the size of the body as it came over the network and
+	`bytes_decoded` its size after libcurl undid any content encoding, so the
+	two only differ when the server compressed the response or, for a body
+	read from the cache, sent none.
+	*/
 	struct response{
 		long code = 0;
 		string body{};
 		headers_t headers{};
+		bool from_cache = false;
+		curl_off_t bytes_received = 0;
+		curl_off_t bytes_decoded = 0;
 		error error();
 	};
 
 
+	/*!
+	@brief How failed GET requests are retried. A request is tried up to
+	`max_attempts` times when it fails with a transient transport error, a
+	5xx status or one of `retry_codes`. The wait before each retry doubles
+	from `base_delay` up to `max_delay`, and a `jitter` fraction of it is
+	randomized so clients that failed together don't retry together.
+	Throttled responses (429 and 503) wait for the server's Retry-After
+	instead.
+
+	With `hedge`, `context::requests()` starts a duplicate of any request
+	that has been running longer than the `hedge_percentile` latency of the
+	requests before it, and keeps whichever finishes first.
+	*/
+	struct retry_policy{
+		int max_attempts							= GDPM_HTTP_RETRY_MAX_ATTEMPTS;
+		std::chrono::milliseconds base_delay		= std::chrono::milliseconds(GDPM_HTTP_RETRY_BASE_DELAY_MS);
+		std::chrono::milliseconds max_delay			= std::chrono::milliseconds(GDPM_HTTP_RETRY_MAX_DELAY_MS);
+		double jitter								= 0.5;
+		bool retry_server_errors					= true;
+		bool retry_transport_errors					= true;
+		std::vector<long> retry_codes				= { REQUEST_TIMEOUT };
+		bool hedge									= false;
+		double hedge_percentile						= 0.95;
+
+		bool should_retry(long code, CURLcode result) const;
+		std::chrono::milliseconds get_delay(int attempt) const;
+	};
+
+	/*!
+	@brief Options for a request. With `use_cache`, GET responses that have
+	an ETag or Last-Modified header are kept on disk and later requests for
+	the same URL are sent as conditional requests. With `compress`, every
+	content encoding libcurl was built with (gzip, deflate, br, zstd) is
+	offered to the server and the body is decoded as it arrives.
+	*/
 	struct request {
 		headers_t headers = {};
 		method method = method::GET;
 		size_t timeout = GDPM_CONFIG_TIMEOUT_MS;
 		int verbose = 0;
+		bool use_cache = false;
+		bool compress = true;
+		retry_policy retry = {};
 	};
 
 	using namespace indicators;
@@ -137,6 +206,82 @@ namespace gdpm::http{
 	// 	option::FontStyles{std::vector<FontStyle>{FontStyle::bold}},
 	// };
 	using responses = std::vector<response>;
+	/*!
+	@brief Called by `context::requests()` as each transfer finishes with the
+	index of its URL in the input list. Transfers finish in any order.
+	*/
+	using response_callback = std::function<void(size_t index, response& r)>;
+
+	/*!
+	@brief Process-wide HTTP settings passed to `initialize()`.
+	`max_host_streams` limits how many requests are multiplexed over one
+	HTTP/2 connection to a host. The response cache lives in `cache_dir` and
+	the least recently used entries are removed once it grows past
+	`cache_max_size` bytes. A size of 0 disables the cache. Downloads of at
+	least two `min_segment_size` chunks are split into up to `max_segments`
+	byte ranges that are fetched in parallel. `max_host_rate` caps the
+	requests per second started against any one host, with bursts of up to
+	a second's worth. A rate of 0 disables the limit.
+	*/
+	struct settings{
+		long max_host_streams	= GDPM_CONFIG_MAX_HOST_STREAMS;
+		double max_host_rate	= GDPM_CONFIG_MAX_HOST_RATE;
+		string cache_dir		= GDPM_HTTP_CACHE_PATH;
+		size_t cache_max_size	= GDPM_HTTP_CACHE_MAX_SIZE;
+		int max_segments		= GDPM_HTTP_MAX_SEGMENTS;
+		size_t min_segment_size	= GDPM_HTTP_MIN_SEGMENT_SIZE;
+	};
+
+	/*!
+	@brief Process-wide libcurl state. Every context and loop shares one DNS
+	cache and TLS session cache through a share handle. Connections are not
+	shared, since contexts run on several threads at once. Easy handles are
+	handed back to a pool instead of being destroyed and keep the
+	connections of the transfers they ran on their own, so only
+	`context::request()` reuses warm keep-alive connections from earlier
+	calls. Transfers on a multi handle, which is everything `requests()`,
+	`download_files()` and a `loop` run, use the connections of that multi
+	handle, and those close with their context or loop. HTTP/2 is negotiated
+	over TLS so concurrent requests to a host share a single connection,
+	falling back to a pool of HTTP/1.1 connections otherwise.
+
+	Contexts and loops create the share handle on first use. `initialize()`
+	only needs to be called to change the settings. `cleanup()` should be
+	called once no contexts are left.
+	*/
+	void initialize(const settings& = settings());
+	void cleanup();
+	CURL* acquire_handle();
+	void release_handle(CURL *curl);
+
+	/*!
+	@brief Congestion window for how many transfers are kept in flight,
+	between 1 and `max_transfers`. Each finished transfer widens it by one
+	below the threshold, which doubles it every round, and by one per round
+	above it. Congestion halves it once per round, and a round that moves
+	less data than the one before settles it one below. A round lasts as
+	many finished transfers as the window was wide.
+	*/
+	class transfer_window{
+	public:
+		transfer_window(int max_transfers = 1);
+
+		void set_max_transfers(int max_transfers);
+		size_t get_limit() const;
+		void update(bool is_congested, curl_off_t bytes, std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now());
+
+	private:
+		int max_transfers = 1;
+		double window = 1.0;
+		double threshold = 1.0;
+		size_t round_finished = 0;
+		curl_off_t round_bytes = 0;
+		bool round_congested = false;
+		double last_throughput = 0.0;
+		std::chrono::steady_clock::time_point round_start;
+	};
+
+	struct _segment;
 
 	class context : public non_copyable{
 	public:
@@ -145,14 +290,51 @@ namespace gdpm::http{
 
 		string url_escape(const string& url);
 		response request(const string& url, const http::request& params = http::request());
+		/*!
+		@brief Makes a request for every URL and returns the responses in the
+		same order as `urls`. A request that fails has a response code of 0.
+
+		The number of requests in flight starts at one and adapts to the
+		server, up to `max_transfers`: it grows while throughput keeps up and
+		is halved when the server answers with 429 or 503 or a transfer times
+		out. Throttled requests are retried after the server's Retry-After.
+		*/
 		responses requests(const string_list& urls, const http::request& params = http::request());
-		response download_file(const string& url, const string& storage_path, const http::request& params = http::request());
-		responses download_files(const string_list& url, const string_list& storage_path, const http::request& params = http::request());
+		error requests(const string_list& urls, const response_callback& on_response, const http::request& params = http::request());
+		/*!
+		@brief Same as `requests()`, but runs on another thread with its own
+		context so the caller can keep working until it needs the responses.
+		*/
+		std::future<responses> requests_async(const string_list& urls, const http::request& params = http::request());
+		/*!
+		@brief Downloads to `<storage_path>.part`, resuming from its size if
+		it already exists, and renames it to `storage_path` once the length
+		and SHA-256 `hash` (when given) match. The response code is OK only
+		if the file at `storage_path` is complete. Runs `loop::download()` on
+		a loop of its own until the file is done.
+		*/
+		response download_file(const string& url, const string& storage_path, const http::request& params = http::request(), const string& hash = "");
+		responses download_files(const string_list& url, const string_list& storage_path, const http::request& params = http::request(), const string_list& hashes = {});
+		/*!
+		@brief Same as `download_files()`, but calls `on_download` as each
+		file finishes so the caller can start working on it while the rest
+		are still downloading.
+		*/
+		error download_files(const string_list& urls, const string_list& storage_paths, const response_callback& on_download, const http::request& params = http::request(), const string_list& hashes = {});
 		long get_download_size(const string& url);
 		long get_bytes_downloaded(const string& url);
 		void set_max_transfers(int max_transfers);
+		/*!
+		@brief Hands a response body back to the context so a later request
+		can receive into its storage instead of allocating a new one.
+		*/
+		void release_buffer(string&& body);
 
 	private:
+		void _record_latency(std::chrono::steady_clock::duration latency);
+		std::chrono::milliseconds _get_hedge_delay(double percentile) const;
+		string _acquire_buffer();
+
 		CURL *curl = nullptr;
 		CURLM *cm = nullptr;
 		CURLMsg *cmessage = nullptr;
@@ -162,6 +344,182 @@ namespace gdpm::http{
 		int transfers_left = -1;
 		DynamicProgress<BlockProgressBar> progress_bars;
 
+		transfer_window window;
+
+		/* The most recent request latencies in milliseconds, for hedging */
+		std::vector<double> latencies;
+		size_t latencies_next = 0;
+
+		/* Emptied response bodies that still own their storage */
+		std::vector<string> buffers;
+
+	};
+
+
+	/*!
+	@brief Event loop that drives transfers with curl_multi_socket_action
+	and epoll instead of blocking in a poll loop, so HTTP can overlap with
+	other work. Operations are coroutines: `co_await loop.get(url)` returns
+	the response and `co_await loop.download(url, path)` a response whose
+	code is OK once the file is complete, like `context::download_file()`.
+	Both follow the request's retry policy, the host rate limits and, for
+	`get()`, the response cache. Blocking work such as hashing or extracting
+	can be run with `co_await loop.offload(f)`, which calls `f` on another
+	thread and resumes the coroutine on the loop with its result.
+
+	Up to `max_transfers` transfers run at once, as many as the
+	`transfer_window` allows, and the rest wait for a free slot. The loop is
+	single-threaded: tasks, their continuations and the libcurl callbacks
+	all run on the thread that called `run()`.
+	*/
+	class loop : public non_copyable{
+	public:
+		loop(int max_transfers = GDPM_CONFIG_SYNC_JOBS);
+		~loop();
+
+		string url_escape(const string& url);
+		task<response> get(string url, http::request params = http::request());
+		/*!
+		@brief Downloads `url` to `storage_path` through a part file, like
+		`context::download_file()`. Large files are fetched in byte ranges
+		that are in flight together, each on a connection of its own. Every
+		range is retried on its own, and a run that still fails keeps them
+		so the next one resumes each range where it stopped.
+		*/
+		task<response> download(string url, string storage_path, http::request params = http::request(), string hash = "");
+
+		/* Suspends the awaiting coroutine for at least `delay` */
+		struct sleep_awaiter{
+			loop *l;
+			std::chrono::milliseconds delay;
+			bool await_ready() const noexcept { return delay.count() <= 0; }
+			void await_suspend(std::coroutine_handle<> h);
+			void await_resume() const noexcept {}
+		};
+		sleep_awaiter sleep_for(std::chrono::milliseconds delay){ return sleep_awaiter{ this, delay }; }
+
+		template <typename F>
+		auto offload(F f){
+			using T = std::invoke_result_t<F>;
+			static_assert(!std::is_void_v<T>, "offloaded functions must return a value");
+			struct awaiter{
+				loop *l;
+				F f;
+				std::optional<T> value;
+				std::exception_ptr exception;
+				awaiter(loop *l, F&& f): l(l), f(std::move(f)){}
+				bool await_ready() const noexcept { return false; }
+				void await_suspend(std::coroutine_handle<> h){
+					l->offloads += 1;
+					std::thread([this, h](){
+						try{
+							value.emplace(f());
+						}
+						catch(...){
+							exception = std::current_exception();
+						}
+						/* The loop checks for posted work and offloads under
+						the same lock, so only stop counting once posted. */
+						loop *owner = l;
+						owner->post(h);
+						owner->offloads -= 1;
+					}).detach();
+				}
+				T await_resume(){
+					if(exception)
+						std::rethrow_exception(exception);
+					return std::move(*value);
+				}
+			};
+			return awaiter(this, std::move(f));
+		}
+
+		/*!
+		@brief Starts `t` on the loop without waiting for it. Spawned tasks
+		are run to completion by `run()`.
+		*/
+		void spawn(task<> t);
+		/*!
+		@brief Runs the loop until `t` has finished and returns its result.
+		Spawned tasks keep running while it waits, but may not be done yet.
+		Throws std::runtime_error if the loop stops before `t` is done, since
+		there is no result to return then.
+		*/
+		template <typename T>
+		T run(task<T> t){
+			ready.emplace_back(t.get_handle());
+			error error = _run_until([&t](){ return t.is_done(); });
+			if(!t.is_done()){
+				/* The loop may still hold on to the task's frame */
+				abandoned.emplace_back(std::make_shared<task<T>>(std::move(t)));
+				throw std::runtime_error(error.get_message());
+			}
+			return t.get_result();
+		}
+		/*!
+		@brief Runs the loop until every spawned task has finished. Returns
+		an error if the loop could not be created or stopped before then.
+		*/
+		error run();
+		/*!
+		@brief Resumes `h` on the loop. Safe to call from any thread.
+		*/
+		void post(std::coroutine_handle<> h);
+
+	private:
+		/* Awaited to run an easy handle on the multi handle */
+		struct transfer_awaiter{
+			loop *l;
+			CURL *eh;
+			bool is_reserved = false;
+			CURLcode result = CURLE_OK;
+			std::coroutine_handle<> handle = nullptr;
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> h);
+			CURLcode await_resume() const noexcept { return result; }
+		};
+		/* Awaited to hold one of the `max_transfers` segmented download slots */
+		struct slot_awaiter{
+			loop *l;
+			bool await_ready() noexcept;
+			void await_suspend(std::coroutine_handle<> h);
+			void await_resume() const noexcept {}
+		};
+		using timer = std::pair<std::chrono::steady_clock::time_point, std::coroutine_handle<>>;
+
+		/* Reserved transfers start right away instead of waiting for the
+		transfer window. The ranges of a segmented download use them, since
+		their download already holds a slot. */
+		transfer_awaiter _perform(CURL *eh, bool is_reserved = false){ return transfer_awaiter{ this, eh, is_reserved }; }
+		slot_awaiter _acquire_slot(){ return slot_awaiter{ this }; }
+		void _release_slot();
+		task<std::optional<response>> _download_segments(string url, string storage_path, http::request params, string hash);
+		task<> _download_range(_segment& s, string url, http::request params);
+		void _start(transfer_awaiter *t);
+		error _run_until(const std::function<bool()>& is_done);
+		void _read_messages();
+		static int _on_socket(CURL *eh, curl_socket_t s, int what, void *userp, void *socketp);
+		static int _on_timer(CURLM *cm, long timeout_ms, void *userp);
+
+		CURLM *cm = nullptr;
+		int epoll_fd = -1;
+		int wake_fd = -1;
+		int max_transfers = GDPM_CONFIG_SYNC_JOBS;
+		transfer_window window;
+		size_t active = 0;
+		size_t slots = 0;
+		std::deque<std::coroutine_handle<>> slot_waiting;
+		std::unordered_set<CURL*> handles;
+		std::optional<std::chrono::steady_clock::time_point> curl_deadline;
+		std::deque<transfer_awaiter*> waiting;
+		std::deque<std::coroutine_handle<>> ready;
+		std::priority_queue<timer, std::vector<timer>, std::greater<timer>> timers;
+		std::vector<task<>> spawned;
+		std::vector<std::shared_ptr<void>> abandoned;
+		error status;
+		std::mutex posted_mutex;
+		std::vector<std::coroutine_handle<>> posted;
+		std::atomic<size_t> offloads = 0;
 	};
 
 
@@ -181,8 +539,54 @@ namespace gdpm::http{
 	// };
 
 	curl_slist* add_headers(CURL *curl, const headers_t& headers);
-	static size_t write_to_buffer(char *contents, size_t size, size_t nmemb, void *userdata);
+	size_t write_to_buffer(char *contents, size_t size, size_t nmemb, void *userdata);
+	static size_t write_to_headers(char *buffer, size_t size, size_t nitems, void *userdata);
 	static size_t write_to_stream(char *ptr, size_t size, size_t nmemb, void *userdata);
 	static int show_download_progress(void *ptr, curl_off_t total_download, curl_off_t current_downloaded, curl_off_t total_upload, curl_off_t current_upload);
 
+	/* Internal helpers of the transfer code, declared here for the tests */
+	struct _body_sink{
+		string *body				= nullptr;
+		CURL *eh					= nullptr;
+		bool is_sized				= false;
+	};
+	struct _cache_entry{
+		string etag;
+		string last_modified;
+		string body;
+	};
+	string _cache_path(const string& url);
+	bool _cache_load(const string& url, _cache_entry& entry);
+	void _cache_store(const string& url, const response& r);
+	curl_off_t _get_range_total(const headers_t& headers);
+	/* One byte range of a segmented download. Each segment writes into its
+	own region of the preallocated file. */
+	struct _segments;
+	struct _segment{
+		int fd						= -1;
+		CURL *eh					= nullptr;
+		_segments *parent			= nullptr;
+		curl_off_t begin			= 0;
+		curl_off_t end				= 0;
+		curl_off_t written			= 0;
+		curl_off_t saved			= 0;
+		string range;
+		bool is_done				= false;
+	};
+	/* A segmented download and where its segments stopped, saved to `path`
+	as it goes so an interrupted download resumes each segment instead of
+	starting over. `validator` is the ETag or Last-Modified of the file. */
+	struct _segments{
+		string path;
+		curl_off_t length			= 0;
+		string validator;
+		std::vector<_segment> list;
+	};
+	bool _save_segments(_segments& s);
+	bool _load_segments(_segments& s);
+	void _remove_segments(const string& storage_path);
+	size_t _write_to_body(char *contents, size_t size, size_t nmemb, void *userdata);
+	long _get_retry_after(const headers_t& headers, int attempt);
+	std::chrono::milliseconds _acquire_host(const string& host);
+
 }
\ No newline at end of file
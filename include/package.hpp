@@ -6,6 +6,7 @@
 #include "types.hpp"
 #include "result.hpp"
 #include "rest_api.hpp"
+#include "task.hpp"
 #include <cstdio>
 #include <filesystem>
 #include <functional>
@@ -18,6 +19,14 @@ namespace gdpm::config{
 	struct context;
 }
 
+namespace gdpm::http{
+	class loop;
+}
+
+namespace gdpm::cache{
+	struct sync_state;
+}
+
 namespace gdpm::package {
 
 	struct info {
@@ -48,6 +57,12 @@ namespace gdpm::package {
 		LOCAL_ONLY			= 3
 	};
 
+	enum sync_method_e : int{
+		SYNC_DELTA			= 0,
+		SYNC_FULL			= 1,
+		SYNC_TARGETED		= 2
+	};
+
 	struct params {
 		args_t 				args;
 		var_opts 			opts;
@@ -55,6 +70,8 @@ namespace gdpm::package {
 		string_list			input_files;
 		string 				remote_source  = "origin";
 		install_method_e 	install_method = GLOBAL_LINK_LOCAL;
+		sync_method_e		sync_method	   = SYNC_DELTA;
+		bool				offline		   = false; /* only for this command, never saved */
 	};
 
 	using info_list 	= std::vector<info>;
@@ -114,7 +131,27 @@ namespace gdpm::package {
 	GDPM_DLL_EXPORT error purge(const config::context& config);
 	GDPM_DLL_EXPORT error link(const config::context& config, const title_list& package_titles, const params& params = package::params());
 	GDPM_DLL_EXPORT error clone(const config::context& config, const title_list& package_titles, const params& params = package::params());
-	GDPM_DLL_EXPORT result_t<info_list> fetch(const config::context& config, const title_list& package_titles);
+	/*!
+	@brief Synchronizes the local package cache with the remote asset list.
+	After the first full sync, only assets modified since the newest
+	`modify_date` seen are requested unless `--full` is passed, which also
+	removes assets that the remote no longer lists. With `SYNC_TARGETED`,
+	only `package_titles` are queried and updated.
+	*/
+	GDPM_DLL_EXPORT result_t<info_list> fetch(const config::context& config, const title_list& package_titles, const params& params = package::params());
+	/*!
+	@brief Returns true if the remote in `params` was synced within
+	`config.sync_ttl` seconds and `--sync` wasn't passed to force a refresh.
+	*/
+	GDPM_DLL_EXPORT bool is_sync_fresh(const config::context& config, const params& params = package::params());
+	/*!
+	@brief Requests the asset details (download URL, description, etc.) of
+	`package` on `loop` if the cache is missing them and fills them in.
+	`doc` gets the asset JSON, or stays a null document if the package
+	already had its details. Awaiting this for several packages at once
+	sends their requests together. `config` has to outlive the task.
+	*/
+	GDPM_DLL_EXPORT task<error> fetch_asset_details(http::loop& loop, const config::context& config, info& package, json::document& doc, package::params params);
 
 
 	GDPM_DLL_EXPORT void print_list(const rapidjson::Document& json);
@@ -130,4 +167,8 @@ namespace gdpm::package {
 	GDPM_DLL_EXPORT result_t<info_list> resolve_dependencies(const config::context& config, const title_list& package_titles);
 
 	GDPM_DLL_EXPORT string to_json(const info& info, bool pretty_print = false);
+
+	/* Internal helpers of the sync code, declared here for the tests */
+	int _get_page_count(const rapidjson::Value& doc);
+	error _fetch_pages(const config::context& config, const string& url, const rest_api::request_params& rest_api_params, int first_page, int total_pages, const std::function<error(const rapidjson::Document&)>& store_page, cache::sync_state& state);
 }
\ No newline at end of file
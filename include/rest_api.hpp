@@ -2,6 +2,7 @@
 
 #include "constants.hpp"
 #include "types.hpp"
+#include "task.hpp"
 #include <rapidjson/document.h>
 #include <rapidjson/writer.h>
 #include <rapidjson/stringbuffer.h>
@@ -12,6 +13,10 @@ namespace gdpm::config{
 	struct context;
 }
 
+namespace gdpm::http{
+	class loop;
+}
+
 namespace gdpm::rest_api{
 	// See GitHub reference: https://github.com/godotengine/godot-asset-library/blob/master/API.md
 	namespace endpoints{
@@ -84,7 +89,29 @@ namespace gdpm::rest_api{
 	bool set_support_level(int asset_id);			// ...for moderators
 
 	namespace multi{
-		json::documents get_assets(const string_list& urls, id_list aset_ids, const request_params& api_params, const string_list& filters);
+		using page_callback = std::function<void(int page, json::document& doc)>;
+
+		/*!
+		@brief Requests the assets with up to `max_transfers` requests in
+		flight. Documents are returned in the same order as `asset_ids`, with
+		a null document for any request that failed.
+		*/
+		json::documents get_assets(const string_list& urls, id_list aset_ids, const request_params& api_params, const string_list& filters, int max_transfers = GDPM_CONFIG_SYNC_JOBS);
+		/*!
+		@brief Requests several pages of the asset list with up to
+		`max_transfers` requests in flight. Each page is parsed and passed to
+		`on_page` as soon as it arrives, so pages are not seen in order. Pages
+		that could not be fetched are passed as a null document.
+		*/
+		error get_assets_list(const string& url, const request_params& params, const std::vector<int>& pages, const page_callback& on_page, int max_transfers, const string& filter = "");
+	}
+
+	namespace async{
+		/*!
+		@brief Same as `rest_api::get_asset()`, but runs on `loop` so it can be
+		awaited alongside downloads and other requests.
+		*/
+		task<json::document> get_asset(http::loop& loop, string url, int asset_id, request_params api_params, string filter = "");
 	}
 	
 	/*
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace gdpm{
+	template <typename T = void>
+	class task;
+
+	namespace detail{
+		/* Resumes whoever was awaiting the task once it has finished, or
+		returns to the event loop if nobody was. */
+		struct final_awaiter{
+			bool await_ready() const noexcept { return false; }
+			template <typename Promise>
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+				std::coroutine_handle<> continuation = h.promise().continuation;
+				return (continuation) ? continuation : std::noop_coroutine();
+			}
+			void await_resume() const noexcept {}
+		};
+
+		struct promise_base{
+			std::coroutine_handle<> continuation;
+			std::exception_ptr exception;
+
+			std::suspend_always initial_suspend() const noexcept { return {}; }
+			final_awaiter final_suspend() const noexcept { return {}; }
+			void unhandled_exception() { exception = std::current_exception(); }
+		};
+
+		template <typename T>
+		struct promise : promise_base{
+			std::optional<T> value;
+
+			task<T> get_return_object();
+			template <typename U>
+			void return_value(U&& v){ value.emplace(std::forward<U>(v)); }
+			T get_result(){
+				if(exception)
+					std::rethrow_exception(exception);
+				return std::move(*value);
+			}
+		};
+
+		template <>
+		struct promise<void> : promise_base{
+			task<void> get_return_object();
+			void return_void() const noexcept {}
+			void get_result(){
+				if(exception)
+					std::rethrow_exception(exception);
+			}
+		};
+	}
+
+	/*!
+	@brief A coroutine that produces a `T`. Tasks are lazy: nothing runs
+	until the task is awaited from another coroutine or handed to an event
+	loop with `run()` or `spawn()`. Awaiting a task runs it until it
+	finishes and then resumes the awaiting coroutine with its result, so
+	tasks compose like ordinary function calls.
+
+	Coroutine parameters are copied into the coroutine frame, so prefer
+	taking them by value since references may dangle once it suspends.
+	*/
+	template <typename T>
+	class task{
+	public:
+		using promise_type = detail::promise<T>;
+		using handle_type = std::coroutine_handle<promise_type>;
+
+		task() = default;
+		explicit task(handle_type h): handle(h){}
+		task(task&& other) noexcept: handle(std::exchange(other.handle, nullptr)){}
+		task& operator=(task&& other) noexcept {
+			if(this != &other){
+				if(handle)
+					handle.destroy();
+				handle = std::exchange(other.handle, nullptr);
+			}
+			return *this;
+		}
+		task(const task&) = delete;
+		task& operator=(const task&) = delete;
+		~task(){
+			if(handle)
+				handle.destroy();
+		}
+
+		bool await_ready() const noexcept { return !handle || handle.done(); }
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+			handle.promise().continuation = awaiting;
+			return handle;
+		}
+		T await_resume(){ return handle.promise().get_result(); }
+
+		bool is_done() const { return !handle || handle.done(); }
+		handle_type get_handle() const { return handle; }
+		T get_result(){ return handle.promise().get_result(); }
+
+	private:
+		handle_type handle = nullptr;
+	};
+
+	namespace detail{
+		template <typename T>
+		task<T> promise<T>::get_return_object(){
+			return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+		}
+
+		inline task<void> promise<void>::get_return_object(){
+			return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+		}
+
+		/* Counts down the tasks of a `when_all()` and keeps the first
+		exception any of them threw. */
+		struct join_state{
+			size_t remaining = 0;
+			std::coroutine_handle<> awaiting = nullptr;
+			std::exception_ptr exception;
+		};
+
+		/* Suspended on by each finished task. The last one hands control
+		to whoever is waiting on all of them, and stays suspended so it can
+		be destroyed safely once they are done. */
+		struct join_awaiter{
+			join_state& state;
+			bool is_last;
+			bool await_ready() const noexcept { return false; }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<>) noexcept {
+				return (is_last && state.awaiting) ? state.awaiting : std::noop_coroutine();
+			}
+			void await_resume() const noexcept {}
+		};
+
+		struct join_all_awaiter{
+			join_state& state;
+			bool await_ready() const noexcept { return state.remaining == 0; }
+			void await_suspend(std::coroutine_handle<> h) noexcept { state.awaiting = h; }
+			void await_resume() const noexcept {}
+		};
+
+		inline task<void> join_one(task<void> t, join_state& state){
+			try{
+				co_await t;
+			}
+			catch(...){
+				if(!state.exception)
+					state.exception = std::current_exception();
+			}
+			state.remaining -= 1;
+			co_await join_awaiter{ state, state.remaining == 0 };
+		}
+	}
+
+	/*!
+	@brief Runs `tasks` at the same time and finishes once all of them have.
+	Each task is started right away and runs until its first suspension, so
+	their transfers overlap on the event loop. If any of them throws, the
+	first exception is rethrown after the rest have finished.
+	*/
+	inline task<void> when_all(std::vector<task<void>> tasks){
+		detail::join_state state;
+		state.remaining = tasks.size();
+		std::vector<task<void>> joins;
+		joins.reserve(tasks.size());
+		for(task<void>& t : tasks)
+			joins.emplace_back(detail::join_one(std::move(t), state));
+		for(task<void>& j : joins)
+			j.get_handle().resume();
+		co_await detail::join_all_awaiter{ state };
+		if(state.exception)
+			std::rethrow_exception(state.exception);
+	}
+}
@@ -27,12 +27,16 @@ namespace gdpm::utils {
 	struct memory_buffer{
 		char *addr = nullptr;
 		size_t size = 0;
+		size_t capacity = 0;
 	};
 
-	static memory_buffer make_buffer(){
+	static memory_buffer make_buffer(size_t capacity = 0){
+		/* ...otherwise allocated on the first write in http::write_to_buffer */
+		char *addr = (capacity > 0) ? (char*)malloc(capacity) : nullptr;
 		return memory_buffer{
-			.addr = (char*)malloc(1), /* ...will grow as needed in curl_write_to_stream */
-			.size = 0
+			.addr = addr,
+			.size = 0,
+			.capacity = (addr != nullptr) ? capacity : 0
 		};
 	}
 
@@ -102,6 +106,11 @@ namespace gdpm::utils {
 	std::string join(const std::vector<std::string>& target, const std::string& delimiter = ", ");
 	std::string join(const std::unordered_map<std::string, std::string>& target, const std::string& prefix = "", const std::string& delimiter = "\n");
 	std::string convert_size(long size);
+	/*!
+	@brief Returns the SHA-256 digest of a file as lower case hex, or an empty
+	string if the file couldn't be read.
+	*/
+	std::string sha256_file(const std::string& path);
 	
 	// TODO: Add function to get size of decompressed zip
 
@@ -1,4 +1,3 @@
-
 #include "cache.hpp"
 #include "error.hpp"
 #include "log.hpp"
@@ -6,10 +5,17 @@
 #include "package.hpp"
 #include "utils.hpp"
 #include "result.hpp"
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
 #include <format>
 #include <tuple>
+#include <unordered_set>
 
 
 namespace gdpm::cache{
@@ -17,459 +23,1197 @@ namespace gdpm::cache{
 		return utils::replace_all(s, "'", "''");
 	}
 
-	bool exists(const params& params) {
-		return std::filesystem::exists(params.cache_path);
+	/* Makes sure a cached statement is reset when it goes out of scope so
+	that it doesn't keep a read transaction open on the connection. */
+	struct _statement_guard{
+		sqlite3_stmt *stmt = nullptr;
+		~_statement_guard(){ if(stmt) sqlite3_reset(stmt); }
+	};
+
+	string _column_string(sqlite3_stmt *stmt, int index){
+		const unsigned char *text = sqlite3_column_text(stmt, index);
+		return (text) ? string(reinterpret_cast<const char*>(text)) : string();
 	}
 
-	error create_package_database(
-		bool overwrite, 
-		const params& params
+	package::info _read_package_info(sqlite3_stmt *stmt){
+		/* Column order follows GDPM_PACKAGE_CACHE_COLNAMES */
+		return package::info{
+			.asset_id 			= static_cast<size_t>(sqlite3_column_int64(stmt, 0)),
+			.type 				= _column_string(stmt, 1),
+			.title 				= _column_string(stmt, 2),
+			.author 			= _column_string(stmt, 3),
+			.author_id 			= static_cast<size_t>(sqlite3_column_int64(stmt, 4)),
+			.version 			= _column_string(stmt, 5),
+			.godot_version 		= _column_string(stmt, 6),
+			.cost 				= _column_string(stmt, 7),
+			.description 		= _column_string(stmt, 8),
+			.modify_date 		= _column_string(stmt, 9),
+			.support_level 		= _column_string(stmt, 10),
+			.category			= _column_string(stmt, 11),
+			.remote_source		= _column_string(stmt, 12),
+			.download_url		= _column_string(stmt, 13),
+			.download_hash 		= _column_string(stmt, 14),
+			.is_installed		= static_cast<bool>(sqlite3_column_int(stmt, 15)),
+			.install_path		= _column_string(stmt, 16)
+		};
+	}
+
+	int _bind_package_info(
+		sqlite3_stmt *stmt,
+		const package::info& p,
+		int offset = 1
 	){
-		sqlite3 *db;
-		sqlite3_stmt *res;
-		char *errmsg;
+		/* Bind order follows GDPM_PACKAGE_CACHE_COLNAMES */
+		int rc = SQLITE_OK;
+		auto bind_text = [&stmt, &rc](int index, const string& s){
+			if(rc == SQLITE_OK)
+				rc = sqlite3_bind_text(stmt, index, s.c_str(), s.size(), SQLITE_TRANSIENT);
+		};
+		auto bind_int = [&stmt, &rc](int index, sqlite3_int64 i){
+			if(rc == SQLITE_OK)
+				rc = sqlite3_bind_int64(stmt, index, i);
+		};
+		bind_int(offset + 0, p.asset_id);
+		bind_text(offset + 1, p.type);
+		bind_text(offset + 2, p.title);
+		bind_text(offset + 3, p.author);
+		bind_int(offset + 4, p.author_id);
+		bind_text(offset + 5, p.version);
+		bind_text(offset + 6, p.godot_version);
+		bind_text(offset + 7, p.cost);
+		bind_text(offset + 8, p.description);
+		bind_text(offset + 9, p.modify_date);
+		bind_text(offset + 10, p.support_level);
+		bind_text(offset + 11, p.category);
+		bind_text(offset + 12, p.remote_source);
+		bind_text(offset + 13, p.download_url);
+		bind_text(offset + 14, p.download_hash);
+		bind_int(offset + 15, p.is_installed);
+		bind_text(offset + 16, p.install_path);
+		return rc;
+	}
+
+
+	database::database(const string& path, bool read_only):
+		path(path),
+		read_only(read_only)
+	{}
+
+
+	database::~database(){
+		close();
+	}
+
+
+	error database::open(){
+		std::lock_guard lock(mutex);
+		if(db != nullptr)
+			return error();
 
 		/* Check and make sure directory is created before attempting to open */
 		namespace fs = std::filesystem;
-		fs::path dir_path = fs::path(params.cache_path).parent_path();
-		if(!fs::exists(dir_path)){
-			log::debug("Creating cache directories...{}", params.cache_path);
+		fs::path dir_path = fs::path(path).parent_path();
+		if(!read_only && !dir_path.empty() && !fs::exists(dir_path)){
+			log::debug("Creating cache directories...{}", path);
 			fs::create_directories(dir_path);
 		}
 
-		int rc = sqlite3_open(params.cache_path.c_str(), &db);
+		int flags = (read_only)
+			? SQLITE_OPEN_READONLY
+			: SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+		int rc = sqlite3_open_v2(path.c_str(), &db, flags, nullptr);
 		if(rc != SQLITE_OK){
-			error error(ec::SQLITE_ERR,
-				std::format(
-					"cache::create_package_database::sqlite3_open(): {}",
-					sqlite3_errmsg(db)
-				)
-			);
+			error error(ec::SQLITE_ERR, std::format(
+				"cache::database::open::sqlite3_open_v2(): {}",
+				sqlite3_errmsg(db)
+			));
 			sqlite3_close(db);
+			db = nullptr;
 			return error;
 		}
 
-		string sql = "CREATE TABLE IF NOT EXISTS " +
-							params.table_name + "("
-							"id INTEGER PRIMARY KEY AUTOINCREMENT,"
-							"asset_id		INT		NOT NULL,"
-							"type			INT		NOT NULL,"
-							"title			TEXT	NOT NULL,"
-							"author			TEXT	NOT NULL,"
-							"author_id		INT		NOT NULL,"
-							"version		TEXT	NOT NULL,"
-							"godot_version	TEXT	NOT NULL,"
-							"cost			TEXT	NOT NULL,"
-							"description	TEXT	NOT NULL,"
-							"modify_date	TEXT	NOT NULL,"
-							"support_level	TEXT	NOT NULL,"
-							"category		TEXT	NOT NULL,"
-							"remote_source	TEXT	NOT NULL,"
-							"download_url	TEXT	NOT NULL,"
-							"download_hash	TEXT	NOT NULL,"
-							"is_installed	TEXT	NOT NULL,"
-							"install_path	TEXT	NOT NULL);";
-
-		// rc = sqlite3_prepare_v2(db, "SELECT", -1, &res, 0);
-		rc = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg);
+		/* Wait for other connections and processes instead of failing with
+		SQLITE_BUSY right away. */
+		sqlite3_busy_timeout(db, busy_timeout);
+		if(read_only)
+			return error();
+
+		/* WAL lets readers continue while a writer holds the lock. The mode is
+		persistent so read-only connections pick it up from the file. */
+		string journal_mode;
+		char *errmsg = nullptr;
+		rc = sqlite3_exec(db, "PRAGMA journal_mode=WAL;",
+			[](void *data, int argc, char **argv, char **){
+				if(argc > 0 && argv[0])
+					*static_cast<string*>(data) = argv[0];
+				return 0;
+			},
+			&journal_mode, &errmsg
+		);
+		if(rc != SQLITE_OK || journal_mode != "wal"){
+			log::warn("cache::database::open(): could not enable WAL journaling ({})",
+				(errmsg) ? errmsg : journal_mode
+			);
+		}
+		sqlite3_free(errmsg);
+		sqlite3_exec(db, "PRAGMA synchronous=NORMAL;", nullptr, nullptr, nullptr);
+
+		/* Rows removed by INSERT OR REPLACE must fire the delete triggers too,
+		otherwise the full-text index keeps stale entries. */
+		sqlite3_exec(db, "PRAGMA recursive_triggers=ON;", nullptr, nullptr, nullptr);
+		return error();
+	}
+
+
+	void database::close(){
+		{
+			std::lock_guard lock(readers->mutex);
+			readers->count -= readers->idle.size();
+			readers->idle.clear();
+		}
+		std::lock_guard lock(mutex);
+		for(auto& [sql, stmt] : statements)
+			sqlite3_finalize(stmt);
+		statements.clear();
+		if(db != nullptr){
+			sqlite3_close(db);
+			db = nullptr;
+		}
+	}
+
+
+	bool database::is_open() const{
+		return db != nullptr;
+	}
+
+
+	bool database::is_read_only() const{
+		return read_only;
+	}
+
+
+	error database::exec(const string& sql){
+		std::lock_guard lock(mutex);
+		error error = open();
+		if(error.has_occurred())
+			return error;
+
+		char *errmsg = nullptr;
+		int rc = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg);
 		if(rc != SQLITE_OK){
-			// log::error("Failed to fetch data: {}\n", sqlite3_errmsg(db));
-			error error(ec::SQLITE_ERR, std::format(
-				"cache::create_package_database::sqlite3_exec(): {}", 
-				errmsg
+			error.set_code(ec::SQLITE_ERR);
+			error.set_message(std::format(
+				"cache::database::exec::sqlite3_exec(): {}",
+				(errmsg) ? errmsg : sqlite3_errmsg(db)
 			));
 			sqlite3_free(errmsg);
-			sqlite3_close(db);
-			return error;
 		}
-		sqlite3_close(db);
-		return error();
+		return error;
 	}
 
 
-	error insert_package_info(
-		const package::info_list& packages, 
-		const params& params
-	){
-		sqlite3 *db;
-		sqlite3_stmt *res;
-		char *errmsg = nullptr;
+	result_t<sqlite3_stmt*> database::prepare(const string& sql){
+		std::lock_guard lock(mutex);
+		error error = open();
+		if(error.has_occurred())
+			return result_t<sqlite3_stmt*>(nullptr, error);
 
-		/* Prepare values to use in sql statement */
-		string sql{"BEGIN TRANSACTION; "};
-		for(const auto& p : packages){
-			sql += "INSERT INTO " + params.table_name + " (" GDPM_PACKAGE_CACHE_COLNAMES ") ";
-			sql += "VALUES (" + to_values(p).unwrap_unsafe() + "); ";
+		/* Reuse the statement if this query shape was already prepared */
+		auto it = statements.find(sql);
+		if(it != statements.end()){
+			sqlite3_reset(it->second);
+			sqlite3_clear_bindings(it->second);
+			return result_t(it->second, error);
 		}
-		sql += "COMMIT;";
-		// log::println("{}", sql);
-		int rc = sqlite3_open(params.cache_path.c_str(), &db);
+
+		sqlite3_stmt *stmt = nullptr;
+		int rc = sqlite3_prepare_v3(db, sql.c_str(), sql.size(), SQLITE_PREPARE_PERSISTENT, &stmt, nullptr);
 		if(rc != SQLITE_OK){
-			error error(ec::SQLITE_ERR, std::format(
-				"cache::insert_package_info::sqlite3_open(): {}", 
-				sqlite3_errmsg(db)
+			error = gdpm::error(ec::SQLITE_ERR, std::format(
+				"cache::database::prepare::sqlite3_prepare_v3(): {}\n\t{}",
+				sqlite3_errmsg(db), sql
 			));
-			sqlite3_close(db);
-			return error;
+			sqlite3_finalize(stmt);
+			return result_t<sqlite3_stmt*>(nullptr, error);
 		}
-		rc = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg);
-		if(rc != SQLITE_OK){
-			error error = log::error_rc(ec::SQLITE_ERR,
-				std::format("cache::insert_package_info::sqlite3_exec(): {}", errmsg)
-			);
-			sqlite3_free(errmsg);
-			sqlite3_close(db);
+		statements.insert({sql, stmt});
+		return result_t(stmt, error);
+	}
+
+
+	error database::begin(){
+		return exec("BEGIN TRANSACTION;");
+	}
+
+
+	error database::commit(){
+		return exec("COMMIT;");
+	}
+
+
+	error database::rollback(){
+		return exec("ROLLBACK;");
+	}
+
+
+	result_t<std::shared_ptr<database>> database::acquire_reader(){
+		/* The writer creates the file and sets WAL mode, so make sure it has
+		been opened before any read-only connection tries to. */
+		error error = open();
+		if(error.has_occurred())
+			return result_t(std::shared_ptr<database>(), error);
+
+		ptr<database> reader;
+		reader_pool& pool = *readers;
+		{
+			std::unique_lock lock(pool.mutex);
+			pool.cv.wait(lock, [&pool](){
+				return !pool.idle.empty() || pool.count < pool.max_count;
+			});
+			if(!pool.idle.empty()){
+				reader = std::move(pool.idle.back());
+				pool.idle.pop_back();
+			}
+			else{
+				pool.count++;
+			}
+		}
+
+		if(!reader){
+			reader = std::make_unique<database>(path, true);
+			reader->set_busy_timeout(busy_timeout);
+			error = reader->open();
+			if(error.has_occurred()){
+				{
+					std::lock_guard lock(pool.mutex);
+					pool.count--;
+				}
+				pool.cv.notify_one();
+				return result_t(std::shared_ptr<database>(), error);
+			}
+		}
+		std::weak_ptr<reader_pool> weak_pool = readers;
+		return result_t(
+			std::shared_ptr<database>(reader.release(), [weak_pool](database *r){ _release_reader(weak_pool, r); }),
+			error
+		);
+	}
+
+
+	void database::_release_reader(const std::weak_ptr<reader_pool>& weak_pool, database *reader){
+		std::shared_ptr<reader_pool> pool = weak_pool.lock();
+		if(!pool){
+			delete reader;
+			return;
+		}
+		{
+			std::lock_guard lock(pool->mutex);
+			if(pool->idle.size() < pool->max_count)
+				pool->idle.emplace_back(reader);
+			else{
+				pool->count--;
+				delete reader;
+			}
+		}
+		pool->cv.notify_one();
+	}
+
+
+	void database::set_busy_timeout(int ms){
+		std::lock_guard lock(mutex);
+		busy_timeout = ms;
+		if(db != nullptr)
+			sqlite3_busy_timeout(db, busy_timeout);
+	}
+
+
+	void database::set_max_readers(size_t count){
+		{
+			std::lock_guard lock(readers->mutex);
+			readers->max_count = std::max<size_t>(count, 1);
+		}
+		readers->cv.notify_all();
+	}
+
+
+	sqlite3* database::get_handle() const{
+		return db;
+	}
+
+
+	const string& database::get_path() const{
+		return path;
+	}
+
+
+	std::recursive_mutex& database::get_mutex(){
+		return mutex;
+	}
+
+
+	std::mutex _databases_mutex;
+	std::unordered_map<string, ptr<database>> _databases;
+
+	database& get_database(const params& params){
+		std::lock_guard lock(_databases_mutex);
+		auto it = _databases.find(params.cache_path);
+		if(it == _databases.end()){
+			it = _databases.insert({
+				params.cache_path,
+				std::make_unique<database>(params.cache_path)
+			}).first;
+		}
+		return *it->second;
+	}
+
+
+	void close_databases(){
+		std::lock_guard lock(_databases_mutex);
+		_databases.clear();
+	}
+
+
+	bool exists(const params& params) {
+		return std::filesystem::exists(params.cache_path);
+	}
+
+
+	/* Each migration is applied once per cache table, in order, and recorded
+	in the schema version table. Append new entries instead of editing old
+	ones so existing caches can be upgraded in place. */
+	const std::vector<migration>& _get_migrations(){
+		static const std::vector<migration> migrations{
+			{1, "create package table", [](const string& t){
+				return "CREATE TABLE IF NOT EXISTS " + t + "("
+					"id INTEGER PRIMARY KEY AUTOINCREMENT,"
+					"asset_id		INT		NOT NULL,"
+					"type			INT		NOT NULL,"
+					"title			TEXT	NOT NULL,"
+					"author			TEXT	NOT NULL,"
+					"author_id		INT		NOT NULL,"
+					"version		TEXT	NOT NULL,"
+					"godot_version	TEXT	NOT NULL,"
+					"cost			TEXT	NOT NULL,"
+					"description	TEXT	NOT NULL,"
+					"modify_date	TEXT	NOT NULL,"
+					"support_level	TEXT	NOT NULL,"
+					"category		TEXT	NOT NULL,"
+					"remote_source	TEXT	NOT NULL,"
+					"download_url	TEXT	NOT NULL,"
+					"download_hash	TEXT	NOT NULL,"
+					"is_installed	TEXT	NOT NULL,"
+					"install_path	TEXT	NOT NULL);";
+			}},
+			{2, "add lookup indexes", [](const string& t){
+				/* Older caches may have duplicate rows which would make the
+				unique index fail, so only keep the newest copy of each. */
+				return "DELETE FROM " + t + " WHERE id NOT IN ("
+						"SELECT MAX(id) FROM " + t + " GROUP BY remote_source, asset_id);"
+					"CREATE UNIQUE INDEX IF NOT EXISTS " + t + "_remote_asset_idx ON " + t + "(remote_source, asset_id);"
+					"CREATE INDEX IF NOT EXISTS " + t + "_asset_id_idx ON " + t + "(asset_id);"
+					"CREATE INDEX IF NOT EXISTS " + t + "_title_idx ON " + t + "(title);"
+					"CREATE INDEX IF NOT EXISTS " + t + "_is_installed_idx ON " + t + "(is_installed);"
+					"CREATE INDEX IF NOT EXISTS " + t + "_category_idx ON " + t + "(category);"
+					"CREATE INDEX IF NOT EXISTS " + t + "_godot_version_idx ON " + t + "(godot_version);";
+			}},
+			{3, "add full-text search index", [](const string& t){
+				/* External content table so the text is only stored once. The
+				triggers keep it in sync with every insert, update and delete. */
+				const string fts = t + "_fts";
+				return "CREATE VIRTUAL TABLE IF NOT EXISTS " + fts + " USING fts5("
+						"title, author, description, category,"
+						"content='" + t + "', content_rowid='id',"
+						"tokenize='unicode61 remove_diacritics 2', prefix='2 3');"
+					"CREATE TRIGGER IF NOT EXISTS " + t + "_fts_insert AFTER INSERT ON " + t + " BEGIN "
+						"INSERT INTO " + fts + "(rowid, title, author, description, category) "
+						"VALUES (new.id, new.title, new.author, new.description, new.category); "
+					"END;"
+					"CREATE TRIGGER IF NOT EXISTS " + t + "_fts_delete AFTER DELETE ON " + t + " BEGIN "
+						"INSERT INTO " + fts + "(" + fts + ", rowid, title, author, description, category) "
+						"VALUES ('delete', old.id, old.title, old.author, old.description, old.category); "
+					"END;"
+					"CREATE TRIGGER IF NOT EXISTS " + t + "_fts_update AFTER UPDATE ON " + t + " BEGIN "
+						"INSERT INTO " + fts + "(" + fts + ", rowid, title, author, description, category) "
+						"VALUES ('delete', old.id, old.title, old.author, old.description, old.category); "
+						"INSERT INTO " + fts + "(rowid, title, author, description, category) "
+						"VALUES (new.id, new.title, new.author, new.description, new.category); "
+					"END;"
+					"INSERT INTO " + fts + "(" + fts + ") VALUES ('rebuild');";
+			}},
+			{4, "add remote sync state", [](const string& t){
+				return "CREATE TABLE IF NOT EXISTS " + t + "_sync("
+					"remote_source		TEXT	PRIMARY KEY,"
+					"newest_modify_date	TEXT	NOT NULL DEFAULT '');";
+			}},
+			{5, "add last synced time", [](const string& t){
+				return "ALTER TABLE " + t + "_sync ADD COLUMN last_synced INTEGER NOT NULL DEFAULT 0;";
+			}},
+			{6, "add staging table for full syncs", [](const string& t){
+				return "CREATE TABLE IF NOT EXISTS " + t + "_staging("
+					"asset_id		INT		NOT NULL,"
+					"type			INT		NOT NULL,"
+					"title			TEXT	NOT NULL,"
+					"author			TEXT	NOT NULL,"
+					"author_id		INT		NOT NULL,"
+					"version		TEXT	NOT NULL,"
+					"godot_version	TEXT	NOT NULL,"
+					"cost			TEXT	NOT NULL,"
+					"description	TEXT	NOT NULL,"
+					"modify_date	TEXT	NOT NULL,"
+					"support_level	TEXT	NOT NULL,"
+					"category		TEXT	NOT NULL,"
+					"remote_source	TEXT	NOT NULL,"
+					"download_url	TEXT	NOT NULL,"
+					"download_hash	TEXT	NOT NULL,"
+					"is_installed	TEXT	NOT NULL,"
+					"install_path	TEXT	NOT NULL,"
+					"PRIMARY KEY (remote_source, asset_id));";
+			}},
+			{7, "add sync checkpoints", [](const string& t){
+				return "ALTER TABLE " + t + "_sync ADD COLUMN checkpoint_query TEXT NOT NULL DEFAULT '';"
+					"ALTER TABLE " + t + "_sync ADD COLUMN checkpoint_page INTEGER NOT NULL DEFAULT -1;"
+					"ALTER TABLE " + t + "_sync ADD COLUMN checkpoint_total_items INTEGER NOT NULL DEFAULT 0;"
+					"ALTER TABLE " + t + "_sync ADD COLUMN checkpoint_modify_date TEXT NOT NULL DEFAULT '';";
+			}}
+		};
+		return migrations;
+	}
+
+
+	error _create_schema_table(database& db){
+		return db.exec(
+			"CREATE TABLE IF NOT EXISTS " GDPM_PACKAGE_CACHE_SCHEMA_TABLENAME "("
+				"table_name		TEXT	NOT NULL,"
+				"version		INT		NOT NULL,"
+				"description	TEXT	NOT NULL,"
+				"applied_at		TEXT	NOT NULL DEFAULT CURRENT_TIMESTAMP,"
+				"PRIMARY KEY (table_name, version));"
+		);
+	}
+
+
+	error initialize(const params& params){
+		database& db = get_database(params);
+		db.set_busy_timeout(params.busy_timeout);
+		db.set_max_readers(params.max_readers);
+		error error = db.open();
+		if(error.has_occurred())
 			return error;
+		return migrate(params);
+	}
+
+
+	result_t<int> get_schema_version(const params& params){
+		database& db = get_database(params);
+		std::lock_guard lock(db.get_mutex());
+		error error = _create_schema_table(db);
+		if(error.has_occurred())
+			return result_t(0, error);
+
+		result_t r_stmt = db.prepare(
+			"SELECT COALESCE(MAX(version), 0) FROM " GDPM_PACKAGE_CACHE_SCHEMA_TABLENAME
+			" WHERE table_name=?;"
+		);
+		error = r_stmt.get_error();
+		if(error.has_occurred())
+			return result_t(0, error);
+
+		_statement_guard guard{r_stmt.unwrap_unsafe()};
+		sqlite3_bind_text(guard.stmt, 1, params.table_name.c_str(), params.table_name.size(), SQLITE_TRANSIENT);
+		if(sqlite3_step(guard.stmt) != SQLITE_ROW){
+			return result_t(0, gdpm::error(ec::SQLITE_ERR, std::format(
+				"cache::get_schema_version::sqlite3_step(): {}",
+				sqlite3_errmsg(db.get_handle())
+			)));
 		}
-		sqlite3_close(db);
-		return error();
+		return result_t(sqlite3_column_int(guard.stmt, 0), error);
 	}
 
 
-	result_t<package::info_list> get_package_info_by_id(
-		const package::id_list& package_ids, 
+	error migrate(const params& params){
+		database& db = get_database(params);
+		std::lock_guard lock(db.get_mutex());
+
+		result_t r_version = get_schema_version(params);
+		error error = r_version.get_error();
+		if(error.has_occurred())
+			return log::error_rc(error);
+
+		int version = r_version.unwrap_unsafe();
+		for(const auto& m : _get_migrations()){
+			if(m.version <= version)
+				continue;
+
+			log::debug("cache::migrate(): applying migration {} ({}) to '{}'", m.version, m.description, params.table_name);
+			error = db.begin();
+			if(error.has_occurred())
+				return log::error_rc(error);
+
+			error = db.exec(m.sql(params.table_name));
+			if(!error.has_occurred()){
+				result_t r_stmt = db.prepare(
+					"INSERT INTO " GDPM_PACKAGE_CACHE_SCHEMA_TABLENAME
+					" (table_name, version, description) VALUES (?, ?, ?);"
+				);
+				error = r_stmt.get_error();
+				if(!error.has_occurred()){
+					_statement_guard guard{r_stmt.unwrap_unsafe()};
+					sqlite3_bind_text(guard.stmt, 1, params.table_name.c_str(), params.table_name.size(), SQLITE_TRANSIENT);
+					sqlite3_bind_int(guard.stmt, 2, m.version);
+					sqlite3_bind_text(guard.stmt, 3, m.description.c_str(), m.description.size(), SQLITE_TRANSIENT);
+					if(sqlite3_step(guard.stmt) != SQLITE_DONE){
+						error = gdpm::error(ec::SQLITE_ERR, std::format(
+							"cache::migrate::sqlite3_step(): {}",
+							sqlite3_errmsg(db.get_handle())
+						));
+					}
+				}
+			}
+			if(error.has_occurred()){
+				db.rollback();
+				return log::error_rc(ec::SQLITE_ERR, std::format(
+					"cache::migrate(): migration {} ({}) failed: {}",
+					m.version, m.description, error.get_message()
+				));
+			}
+
+			error = db.commit();
+			if(error.has_occurred())
+				return log::error_rc(error);
+		}
+		return error;
+	}
+
+
+	error create_package_database(
+		bool overwrite,
 		const params& params
 	){
-		sqlite3 *db;
-		sqlite3_stmt *res;
-		char *errmsg = nullptr;
-		size_t p_size = 0;
-		package::info_list p_vector;
-		string sql{"BEGIN TRANSACTION;\n"};
-
-		auto callback = [](void *data, int argc, char **argv, char **colnames){
-			package::info_list *_p_vector = (package::info_list*) data;
-			package::info p{
-				.asset_id 			= std::stoul(argv[1]),
-				.type 				= argv[2],
-				.title 				= argv[3],
-				.author 			= argv[4],
-				.author_id 			= std::stoul(argv[5]),
-				.version 			= argv[6],
-				.godot_version 		= argv[7],
-				.cost 				= argv[8],
-				.description 		= argv[9],
-				.modify_date 		= argv[10],
-				.support_level 		= argv[11],
-				.category			= argv[12],
-				.remote_source		= argv[13],
-				.download_url		= argv[14],
-				.download_hash 		= argv[15],
-				.is_installed		= static_cast<bool>(std::stoi(argv[16])),
-				.install_path		= argv[17]
-			};
-			_p_vector->emplace_back(p);
-			return 0;
-		};
+		if(overwrite){
+			error error = drop_package_database(params);
+			if(error.has_occurred())
+				return error;
+		}
 
-		int rc = sqlite3_open(params.cache_path.c_str(), &db);
-		if(rc != SQLITE_OK){
-			error error(ec::SQLITE_ERR, std::format(
-				"cache::get_package_info_by_id::sqlite3_open(): {}", sqlite3_errmsg(db)
+		error error = migrate(params);
+		if(error.has_occurred()){
+			error.set_message(std::format(
+				"cache::create_package_database(): {}",
+				error.get_message()
 			));
-			sqlite3_close(db);
+		}
+		return error;
+	}
+
+
+	result_t<package::info_list> _select_package_info(
+		const string& sql,
+		const string& caller,
+		const std::function<int(sqlite3_stmt*)>& bind,
+		const params& params
+	){
+		/* Lookups go through a pooled read-only connection so that worker
+		threads don't serialize on the writer. */
+		result_t r_reader = get_database(params).acquire_reader();
+		error error = r_reader.get_error();
+		if(error.has_occurred()){
+			error.set_message(std::format("cache::{}(): {}", caller, error.get_message()));
+			return result_t(package::info_list(), error);
+		}
+		std::shared_ptr<database> reader = r_reader.unwrap_unsafe();
+		database& db = *reader;
+		std::lock_guard lock(db.get_mutex());
+		package::info_list p_vector;
+
+		result_t r_stmt = db.prepare(sql);
+		error = r_stmt.get_error();
+		if(error.has_occurred()){
+			error.set_message(std::format("cache::{}(): {}", caller, error.get_message()));
 			return result_t(package::info_list(), error);
 		}
-		
-		for(const auto& p_id : package_ids){
-			sql += "SELECT * FROM " + params.table_name + " WHERE asset_id=" + std::to_string(p_id)+ ";\n";
+
+		_statement_guard guard{r_stmt.unwrap_unsafe()};
+		int rc = bind(guard.stmt);
+		while(rc == SQLITE_OK && (rc = sqlite3_step(guard.stmt)) == SQLITE_ROW){
+			p_vector.emplace_back(_read_package_info(guard.stmt));
+			rc = SQLITE_OK;
 		}
-		sql += "COMMIT;\n";
-		rc = sqlite3_exec(db, sql.c_str(), callback, (void*)&p_vector, &errmsg);
-		if(rc != SQLITE_OK){
-			error error(ec::SQLITE_ERR, std::format(
-				"cache::get_package_info_by_id::sqlite3_exec(): {}", errmsg
+		if(rc != SQLITE_DONE){
+			error = gdpm::error(ec::SQLITE_ERR, std::format(
+				"cache::{}::sqlite3_step(): {}",
+				caller, sqlite3_errmsg(db.get_handle())
 			));
-			sqlite3_free(errmsg);
-			sqlite3_close(db);
 			return result_t(package::info_list(), error);
 		}
-		sqlite3_close(db);
-		return result_t(p_vector, error());
+		return result_t(p_vector, error);
 	}
 
 
-	result_t<package::info_list> get_package_info_by_title(
-		const package::title_list& package_titles, 
+	string _to_json_value(size_t id){
+		return std::to_string(id);
+	}
+
+
+	string _to_json_value(const string& s){
+		string json{"\""};
+		for(unsigned char c : s){
+			switch(c){
+				case '"':	json += "\\\""; break;
+				case '\\':	json += "\\\\"; break;
+				default:
+					if(c < 0x20)	json += std::format("\\u{:04x}", static_cast<int>(c));
+					else			json += c;
+			}
+		}
+		return json + "\"";
+	}
+
+
+	/* Builds a JSON array from the keys skipping any duplicates so the whole
+	list can be bound to one parameter and read back with json_each(). */
+	template <typename T>
+	string _to_json_array(const std::vector<T>& keys){
+		string json{"["};
+		std::unordered_set<T> seen;
+		for(const auto& key : keys){
+			if(!seen.insert(key).second)
+				continue;
+			if(json.size() > 1)
+				json += ",";
+			json += _to_json_value(key);
+		}
+		return json + "]";
+	}
+
+
+	/* Looks up every key with a single query by binding them as one JSON
+	array and joining against json_each(). Rows come back in the same order
+	as the keys with duplicate keys only looked up once. Titles aren't unique
+	across authors or remotes, so each key returns a single row, preferring
+	an installed package and then the one cached first. */
+	template <typename T>
+	result_t<package::info_list> _select_package_info_by_keys(
+		const string& column,
+		const std::vector<T>& keys,
+		const string& caller,
 		const params& params
 	){
-		sqlite3 *db;
-		sqlite3_stmt *res;
-		char *errmsg = nullptr;
-		package::info_list p_vector;
+		if(keys.empty())
+			return result_t(package::info_list(), error());
 
-		auto callback = [](void *data, int argc, char **argv, char **colnames){
-			if(argc <= 0)
-				return 1;
-			package::info_list *_p_vector = (package::info_list*)data;
-			// log::println("get_package_info_by_title.callback.argv: \n\t{}\n\t{}\n\t{}\n\t{}\n\t{}", argv[0], argv[1], argv[2],argv[3], argv[4]);
-			package::info p{
-				.asset_id 			= std::stoul(argv[1]),
-				.type 				= argv[2],
-				.title 				= argv[3],
-				.author 			= argv[4],
-				.author_id 			= std::stoul(argv[5]),
-				.version 			= argv[6],
-				.godot_version 		= argv[7],
-				.cost 				= argv[8],
-				.description 		= argv[9],
-				.modify_date 		= argv[10],
-				.support_level 		= argv[11],
-				.category			= argv[12],
-				.remote_source		= argv[13],
-				.download_url		= argv[14],
-				.download_hash 		= argv[15],
-				.is_installed		= static_cast<bool>(std::stoi(argv[16])),
-				.install_path		= argv[17]
-			};
-			_p_vector->emplace_back(p);
-			return 0;
+		string json = _to_json_array(keys);
+		string sql{
+			"SELECT " GDPM_PACKAGE_CACHE_COLNAMES " FROM ("
+				"SELECT *, ROW_NUMBER() OVER ("
+					"PARTITION BY input_index ORDER BY is_installed DESC, id"
+				") AS key_rank FROM " + params.table_name + " JOIN ("
+					"SELECT key AS input_index, value AS input_key FROM json_each(?)"
+				") ON " + column + "=input_key"
+			") WHERE key_rank=1 ORDER BY input_index;"
 		};
+		return _select_package_info(sql, caller,
+			[&json](sqlite3_stmt *stmt){
+				return sqlite3_bind_text(stmt, 1, json.c_str(), json.size(), SQLITE_TRANSIENT);
+			},
+			params
+		);
+	}
 
-		/* Check to make sure the directory is there before attempting to open */
-		if(!std::filesystem::exists(params.cache_path))
-			std::filesystem::create_directories(params.cache_path);
 
-		int rc = sqlite3_open(params.cache_path.c_str(), &db);
-		if(rc != SQLITE_OK){
-			error error(ec::SQLITE_ERR, std::format(
-				"cache::get_package_info_by_title::sqlite3_open(): {}", sqlite3_errmsg(db)
-			));
-			sqlite3_close(db);
-			return result_t(package::info_list(), error);
-		}
+	result_t<package::info_list> get_package_info_by_id(
+		const package::id_list& package_ids,
+		const params& params
+	){
+		return _select_package_info_by_keys("asset_id", package_ids, "get_package_info_by_id", params);
+	}
 
-		string sql{"BEGIN TRANSACTION;"};
-		for(const auto& p_title : package_titles){
-			sql += "SELECT * FROM " + params.table_name + " WHERE title='" + p_title + "';";
-		}
-		sql += "COMMIT;";
-		// log::println(sql);
-		rc = sqlite3_exec(db, sql.c_str(), callback, (void*)&p_vector, &errmsg);
-		if(rc != SQLITE_OK){
-			error error(ec::SQLITE_ERR, std::format(
-				"cache::get_package_info_by_title::sqlite3_exec(): {}", errmsg
-			));
-			sqlite3_free(errmsg);
-			sqlite3_close(db);
-			return result_t(package::info_list(), error);
+
+	result_t<package::info_list> get_package_info_by_title(
+		const package::title_list& package_titles,
+		const params& params
+	){
+		return _select_package_info_by_keys("title", package_titles, "get_package_info_by_title", params);
+	}
+
+
+	/* Turns free text into an FTS5 query where every word has to match as a
+	prefix, quoting each one so that user input can't inject query syntax. */
+	string _to_fts_query(const string& text){
+		string query;
+		std::istringstream stream(text);
+		for(string word; stream >> word;){
+			if(!query.empty())
+				query += " ";
+			query += "\"" + utils::replace_all(word, "\"", "\"\"") + "\"*";
 		}
-		sqlite3_close(db);
-		return result_t(p_vector, error());
+		return query;
 	}
 
 
-	result_t<package::info_list> get_installed_packages(const params& params){
-		sqlite3 *db;
-		sqlite3_stmt *res;
-		char *errmsg = nullptr;
-		package::info_list p_vector;
-		string sql{"BEGIN TRANSACTION;"};
-
-		auto callback = [](void *data, int argc, char **argv, char **colnames){
-			package::info_list *_p_vector = (package::info_list*) data;
-			package::info p{
-				.asset_id 			= std::stoul(argv[1]),
-				.type 				= argv[2],
-				.title 				= argv[3],
-				.author 			= argv[4],
-				.author_id 			= std::stoul(argv[5]),
-				.version 			= argv[6],
-				.godot_version 		= argv[7],
-				.cost 				= argv[8],
-				.description 		= argv[9],
-				.modify_date 		= argv[10],
-				.support_level 		= argv[11],
-				.category			= argv[12],
-				.remote_source		= argv[13],
-				.download_url		= argv[14],
-				.download_hash 		= argv[15],
-				.is_installed		= static_cast<bool>(std::stoi(argv[16])),
-				.install_path		= argv[17]
+	result_t<package::info_list> search_package_info(
+		const string& text,
+		int max_results,
+		const params& params
+	){
+		/* Title matches weigh the most, then author, category and description.
+		Ties fall back to the most recently updated asset like the asset
+		library's default ordering. */
+		string query = _to_fts_query(text);
+		if(query.empty()){
+			string sql{
+				"SELECT " GDPM_PACKAGE_CACHE_COLNAMES " FROM " + params.table_name +
+				" ORDER BY modify_date DESC LIMIT ?;"
 			};
-			_p_vector->emplace_back(p);
-			return 0;
+			return _select_package_info(sql, "search_package_info",
+				[max_results](sqlite3_stmt *stmt){
+					return sqlite3_bind_int(stmt, 1, (max_results > 0) ? max_results : -1);
+				},
+				params
+			);
+		}
+
+		string sql{
+			"SELECT " GDPM_PACKAGE_CACHE_COLNAMES " FROM " + params.table_name + " JOIN ("
+				"SELECT rowid AS fts_id, bm25(" + params.table_name + "_fts, 10.0, 5.0, 1.0, 2.0) AS score "
+				"FROM " + params.table_name + "_fts WHERE " + params.table_name + "_fts MATCH ?"
+			") ON fts_id=id ORDER BY score, modify_date DESC LIMIT ?;"
 		};
+		return _select_package_info(sql, "search_package_info",
+			[&query, max_results](sqlite3_stmt *stmt){
+				int rc = sqlite3_bind_text(stmt, 1, query.c_str(), query.size(), SQLITE_TRANSIENT);
+				if(rc == SQLITE_OK)
+					rc = sqlite3_bind_int(stmt, 2, (max_results > 0) ? max_results : -1);
+				return rc;
+			},
+			params
+		);
+	}
 
-		int rc = sqlite3_open(params.cache_path.c_str(), &db);
-		if(rc != SQLITE_OK){
-			error error(ec::SQLITE_ERR, std::format(
-				"cache::get_installed_packages::sqlite3_open(): {}", sqlite3_errmsg(db)
-			));
-			sqlite3_close(db);
-			return result_t(package::info_list(), error);
-		}
 
-		sql += "SELECT * FROM " + params.table_name + " WHERE is_installed=1; COMMIT;";
-		rc = sqlite3_exec(db, sql.c_str(), callback, (void*)&p_vector, &errmsg);
-		if(rc != SQLITE_OK){
-			error error(ec::SQLITE_ERR, std::format(
-				"cache::get_installed_packages::sqlite3_exec(): {}", errmsg
-			));
+	result_t<package::info_list> get_installed_packages(const params& params){
+		string sql{"SELECT " GDPM_PACKAGE_CACHE_COLNAMES " FROM " + params.table_name + " WHERE is_installed=1;"};
+		result_t result = _select_package_info(sql, "get_installed_packages",
+			[](sqlite3_stmt *stmt){ return SQLITE_OK; },
+			params
+		);
+		error error = result.get_error();
+		if(error.has_occurred())
 			log::error(error);
-			sqlite3_free(errmsg);
-			sqlite3_close(db);
-			return result_t(package::info_list(), error);
-		}
-		sqlite3_close(db);
-		return result_t(p_vector, error());
+		return result;
 	}
 
 
-	error update_package_info(
-		const package::info_list& packages, 
-		const params& params
+	/* Runs the same prepared statement once per item inside of a single
+	transaction and rolls back everything if any of them fails. */
+	template <typename T>
+	error _execute_each(
+		const string& sql,
+		const string& caller,
+		const std::vector<T>& items,
+		const std::function<int(sqlite3_stmt*, const T&)>& bind,
+		const params& params,
+		size_t *changes = nullptr
 	){
-		sqlite3 *db;
-		sqlite3_stmt *res;
-		char *errmsg = nullptr;
-		
-		int rc = sqlite3_open(params.cache_path.c_str(), &db);
-		if(rc != SQLITE_OK){
-			error error(
-				ec::SQLITE_ERR, std::format(
-				"cache::update_package_info::sqlite3_open(): {}", sqlite3_errmsg(db)
-			));
-			sqlite3_close(db);
+		database& db = get_database(params);
+		std::lock_guard lock(db.get_mutex());
+		if(items.empty())
+			return error();
+
+		result_t r_stmt = db.prepare(sql);
+		error error = r_stmt.get_error();
+		if(error.has_occurred()){
+			error.set_message(std::format("cache::{}(): {}", caller, error.get_message()));
 			return error;
 		}
-		
-		string sql;
-		for(const auto& p : packages){
-			sql += "UPDATE " 	+ params.table_name + " SET "
-			" asset_id=" 		+ std::to_string(p.asset_id) + ", "
-			" type='" 			+ _escape_sql(p.type) + "', "
-			" title='" 			+ _escape_sql(p.title) + "', "
-			" author='" 		+ _escape_sql(p.author) + "', " + 
-			" author_id=" 		+ std::to_string(p.author_id) + ", "
-			" version='" 		+ _escape_sql(p.version) + "', " + 
-			" godot_version='" 	+ _escape_sql(p.godot_version) + "', " +
-			" cost='" 			+ _escape_sql(p.cost) + "', " +
-			" description='" 	+ _escape_sql(p.description) + "', " +
-			" modify_date='" 	+ _escape_sql(p.modify_date) + "', " +
-			" support_level='" 	+ _escape_sql(p.support_level) + "', " +
-			" category='" 		+ _escape_sql(p.category) + "', " +
-			" remote_source='" 	+ _escape_sql(p.remote_source) + "', " +
-			" download_url='" 	+ _escape_sql(p.download_url) + "', " + 
-			" download_hash='" 	+ _escape_sql(p.download_hash) + "', " +
-			" is_installed=" 	+ std::to_string(p.is_installed) + ", " 
-			" install_path='" 	+ _escape_sql(p.install_path) + "'"
-			// " dependencies='" + p.dependencies + "'"
-			" WHERE title='" 	+ p.title + "' AND asset_id=" + std::to_string(p.asset_id)
-			+ ";\n";
-		}
-		rc = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg);
-		if(rc != SQLITE_OK){
-			error error(ec::SQLITE_ERR, std::format(
-				"cache::update_package_info::sqlite3_exec(): {}\n\t{}", errmsg, sql
-			));
-			sqlite3_free(errmsg);
-			sqlite3_close(db);
+
+		error = db.begin();
+		if(error.has_occurred())
 			return error;
+
+		sqlite3_stmt *stmt = r_stmt.unwrap_unsafe();
+		for(const auto& item : items){
+			sqlite3_reset(stmt);
+			sqlite3_clear_bindings(stmt);
+			int rc = bind(stmt, item);
+			if(rc == SQLITE_OK)
+				rc = sqlite3_step(stmt);
+			if(rc != SQLITE_DONE){
+				error = gdpm::error(ec::SQLITE_ERR, std::format(
+					"cache::{}::sqlite3_step(): {}",
+					caller, sqlite3_errmsg(db.get_handle())
+				));
+				sqlite3_reset(stmt);
+				db.rollback();
+				return error;
+			}
+			if(changes)
+				*changes += sqlite3_changes(db.get_handle());
 		}
-		sqlite3_close(db);
-		return error();
+		sqlite3_reset(stmt);
+		return db.commit();
 	}
 
 
-	error delete_packages(
-		const package::title_list& package_titles, 
+	error insert_package_info(
+		const package::info_list& packages,
 		const params& params
 	){
-		sqlite3 *db;
-		sqlite3_stmt *res;
-		char *errmsg = nullptr;
-		string sql;
+		result_t result = bulk_insert_package_info(packages, params);
+		error error = result.get_error();
+		if(error.has_occurred())
+			return log::error_rc(error);
+		return error;
+	}
 
-		int rc = sqlite3_open(params.cache_path.c_str(), &db);
-		if(rc != SQLITE_OK){
-			error error(ec::SQLITE_ERR, std::format(
-				"cache::delete_packages::sqlite3_open(): {}", sqlite3_errmsg(db)
-			));
-			sqlite3_close(db);
-			return error;
+
+	result_t<insert_stats> bulk_insert_package_info(
+		const package::info_list& packages,
+		const params& params
+	){
+		/* INSERT OR REPLACE would delete and re-insert rows that are already
+		cached and lose their install state, so insert through the upsert. */
+		return upsert_package_info(packages, params);
+	}
+
+
+	/* Rows are matched on (remote_source, asset_id) and only rewritten when
+	the remote data actually changed. Local state like is_installed and
+	install_path is never touched. Details that aren't part of the asset
+	list (description, download URL, etc.) are kept as long as the asset
+	hasn't been modified and cleared otherwise so they get fetched again. */
+	string _upsert_clause(){
+		const string_list remote_columns{
+			"type", "title", "author", "author_id", "version", "godot_version",
+			"cost", "modify_date", "category"
+		};
+		const string_list detail_columns{
+			"description", "support_level", "download_url", "download_hash"
+		};
+		string assignments, changed;
+		for(const auto& column : remote_columns){
+			assignments += std::format("{0}=excluded.{0}, ", column);
+			changed += std::format("excluded.{0} IS NOT {0} OR ", column);
 		}
+		for(const auto& column : detail_columns){
+			assignments += std::format(
+				"{0}=CASE WHEN excluded.{0}<>'' THEN excluded.{0} "
+				"WHEN excluded.modify_date=modify_date THEN {0} ELSE '' END, ",
+				column
+			);
+			changed += std::format("(excluded.{0}<>'' AND excluded.{0} IS NOT {0}) OR ", column);
+		}
+		assignments.resize(assignments.size() - 2);
+		changed.resize(changed.size() - 4);
+		return " ON CONFLICT(remote_source, asset_id) DO UPDATE SET " + assignments + " WHERE " + changed;
+	}
 
-		for(const auto& p_title : package_titles){
-			sql += "DELETE FROM " + params.table_name + " WHERE title='"
-			+ p_title + "';\n";
+
+	result_t<insert_stats> upsert_package_info(
+		const package::info_list& packages,
+		const params& params
+	){
+		using namespace std::chrono;
+
+		string sql{
+			"INSERT INTO " + params.table_name + " (" GDPM_PACKAGE_CACHE_COLNAMES ") "
+			"VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)" + _upsert_clause() + ";"
+		};
+		auto start = steady_clock::now();
+		size_t changes = 0;
+		error error = _execute_each<package::info>(sql, "upsert_package_info", packages,
+			[](sqlite3_stmt *stmt, const package::info& p){
+				return _bind_package_info(stmt, p);
+			},
+			params,
+			&changes
+		);
+		insert_stats stats{
+			.rows		= (error.has_occurred()) ? 0 : packages.size(),
+			.changed	= (error.has_occurred()) ? 0 : changes,
+			.seconds	= duration<double>(steady_clock::now() - start).count()
+		};
+		log::debug("cache::upsert_package_info(): {} rows ({} changed) in {:.3f}s ({:.0f} rows/sec)",
+			stats.rows, stats.changed, stats.seconds, stats.rows_per_second()
+		);
+		return result_t(stats, error);
+	}
+
+
+	error clear_staged_packages(
+		const string& remote_source,
+		const params& params
+	){
+		string sql{"DELETE FROM " + params.table_name + "_staging WHERE remote_source=?;"};
+		return _execute_each<string>(sql, "clear_staged_packages", {remote_source},
+			[](sqlite3_stmt *stmt, const string& remote_source){
+				return sqlite3_bind_text(stmt, 1, remote_source.c_str(), remote_source.size(), SQLITE_TRANSIENT);
+			},
+			params
+		);
+	}
+
+
+	result_t<insert_stats> stage_package_info(
+		const package::info_list& packages,
+		const params& params
+	){
+		using namespace std::chrono;
+
+		string sql{
+			"INSERT OR REPLACE INTO " + params.table_name + "_staging (" GDPM_PACKAGE_CACHE_COLNAMES ") "
+			"VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?);"
+		};
+		auto start = steady_clock::now();
+		error error = _execute_each<package::info>(sql, "stage_package_info", packages,
+			[](sqlite3_stmt *stmt, const package::info& p){
+				return _bind_package_info(stmt, p);
+			},
+			params
+		);
+		/* Nothing reaches the cache until the swap, which counts the rows
+		that actually changed. */
+		insert_stats stats{
+			.rows		= (error.has_occurred()) ? 0 : packages.size(),
+			.changed	= 0,
+			.seconds	= duration<double>(steady_clock::now() - start).count()
+		};
+		return result_t(stats, error);
+	}
+
+
+	result_t<swap_stats> swap_staged_packages(
+		const string& remote_source,
+		size_t expected_rows,
+		const params& params
+	){
+		using namespace std::chrono;
+
+		database& db = get_database(params);
+		std::lock_guard lock(db.get_mutex());
+		swap_stats stats;
+		auto start = steady_clock::now();
+
+		/* Everything happens in one transaction so readers keep seeing the
+		previous catalog until the commit and an interrupted swap leaves the
+		cache untouched. Installed packages are never removed. */
+		const string& t = params.table_name;
+		const string_list statements{
+			"DELETE FROM " + t + " WHERE remote_source=?1 AND is_installed=0 AND NOT EXISTS ("
+				"SELECT 1 FROM " + t + "_staging AS s "
+				"WHERE s.remote_source=" + t + ".remote_source AND s.asset_id=" + t + ".asset_id);",
+			"INSERT INTO " + t + " (" GDPM_PACKAGE_CACHE_COLNAMES ") "
+				"SELECT " GDPM_PACKAGE_CACHE_COLNAMES " FROM " + t + "_staging WHERE remote_source=?1"
+				+ _upsert_clause() + ";",
+			"DELETE FROM " + t + "_staging WHERE remote_source=?1;"
+		};
+		size_t *counters[] = { &stats.removed, &stats.changed, &stats.rows };
+
+		error error = db.exec("BEGIN IMMEDIATE;");
+		if(error.has_occurred())
+			return result_t(stats, error);
+
+		/* A short staging table means some pages were never fetched */
+		result_t r_count = db.prepare("SELECT COUNT(*) FROM " + t + "_staging WHERE remote_source=?1;");
+		error = r_count.get_error();
+		if(!error.has_occurred()){
+			_statement_guard guard{r_count.unwrap_unsafe()};
+			sqlite3_bind_text(guard.stmt, 1, remote_source.c_str(), remote_source.size(), SQLITE_TRANSIENT);
+			size_t staged = (sqlite3_step(guard.stmt) == SQLITE_ROW) ? sqlite3_column_int64(guard.stmt, 0) : 0;
+			if(staged < expected_rows){
+				error = gdpm::error(ec::PRECONDITION_FAILED, std::format(
+					"cache::swap_staged_packages(): only {} of {} packages were staged",
+					staged, expected_rows
+				));
+			}
 		}
-		rc = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg);
-		if(rc != SQLITE_OK){
-			error error(ec::SQLITE_ERR, std::format(
-				"cache::delete_packages::sqlite3_exec(): {}", errmsg
-			));
-			sqlite3_free(errmsg);
-			sqlite3_close(db);
-			return error;
+
+		for(size_t i = 0; i < statements.size() && !error.has_occurred(); i++){
+			result_t r_stmt = db.prepare(statements[i]);
+			error = r_stmt.get_error();
+			if(error.has_occurred())
+				break;
+
+			_statement_guard guard{r_stmt.unwrap_unsafe()};
+			sqlite3_bind_text(guard.stmt, 1, remote_source.c_str(), remote_source.size(), SQLITE_TRANSIENT);
+			if(sqlite3_step(guard.stmt) != SQLITE_DONE){
+				error = gdpm::error(ec::SQLITE_ERR, std::format(
+					"cache::swap_staged_packages::sqlite3_step(): {}",
+					sqlite3_errmsg(db.get_handle())
+				));
+				break;
+			}
+			*counters[i] = sqlite3_changes(db.get_handle());
 		}
-		sqlite3_close(db);
-		return error();
+		if(error.has_occurred()){
+			db.rollback();
+			return result_t(swap_stats(), error);
+		}
+
+		error = db.commit();
+		stats.seconds = duration<double>(steady_clock::now() - start).count();
+		log::debug("cache::swap_staged_packages(): {} staged, {} changed, {} removed in {:.3f}s",
+			stats.rows, stats.changed, stats.removed, stats.seconds
+		);
+		return result_t(stats, error);
 	}
 
 
-	error delete_packages(
-		const package::id_list& package_ids, 
+	result_t<sync_state> get_sync_state(
+		const string& remote_source,
 		const params& params
 	){
-		sqlite3 *db;
-		sqlite3_stmt *res;
-		char *errmsg = nullptr;
-		string sql;
+		database& db = get_database(params);
+		std::lock_guard lock(db.get_mutex());
+		sync_state state{ .remote_source = remote_source };
 
-		int rc = sqlite3_open(params.cache_path.c_str(), &db);
-		if(rc != SQLITE_OK){
-			error error(ec::SQLITE_ERR, std::format(
-				"cache::delete_packages::sqlite3_open(): {}", errmsg
-			));
-			sqlite3_close(db);
-			return error;
+		result_t r_stmt = db.prepare(
+			"SELECT newest_modify_date, last_synced, checkpoint_query, checkpoint_page, "
+			"checkpoint_total_items, checkpoint_modify_date "
+			"FROM " + params.table_name + "_sync WHERE remote_source=?;"
+		);
+		error error = r_stmt.get_error();
+		if(error.has_occurred()){
+			error.set_message(std::format("cache::get_sync_state(): {}", error.get_message()));
+			return result_t(state, error);
 		}
 
-		for(const auto& p_id : package_ids){
-			sql += "DELETE FROM " + params.table_name + " WHERE asset_id="
-			+ std::to_string(p_id) + ";\n";
+		_statement_guard guard{r_stmt.unwrap_unsafe()};
+		sqlite3_bind_text(guard.stmt, 1, remote_source.c_str(), remote_source.size(), SQLITE_TRANSIENT);
+		int rc = sqlite3_step(guard.stmt);
+		if(rc == SQLITE_ROW){
+			state.newest_modify_date	= _column_string(guard.stmt, 0);
+			state.last_synced			= sqlite3_column_int64(guard.stmt, 1);
+			state.checkpoint = sync_checkpoint{
+				.query				= _column_string(guard.stmt, 2),
+				.page				= sqlite3_column_int(guard.stmt, 3),
+				.total_items		= sqlite3_column_int(guard.stmt, 4),
+				.newest_modify_date	= _column_string(guard.stmt, 5)
+			};
 		}
-		rc = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg);
-		if(rc != SQLITE_OK){
-			error error(ec::SQLITE_ERR, std::format(
-				"cache::delete_packages::sqlite3_exec(): {}", errmsg
+		else if(rc != SQLITE_DONE){
+			error = gdpm::error(ec::SQLITE_ERR, std::format(
+				"cache::get_sync_state::sqlite3_step(): {}",
+				sqlite3_errmsg(db.get_handle())
 			));
-			sqlite3_free(errmsg);
-			sqlite3_close(db);
-			return error;
 		}
-		sqlite3_close(db);
-		return error();
+		return result_t(state, error);
+	}
+
+
+	error set_sync_state(
+		const sync_state& state,
+		const params& params
+	){
+		string sql{
+			"INSERT INTO " + params.table_name + "_sync (remote_source, newest_modify_date, last_synced, "
+				"checkpoint_query, checkpoint_page, checkpoint_total_items, checkpoint_modify_date) "
+			"VALUES (?, ?, ?, ?, ?, ?, ?) "
+			"ON CONFLICT(remote_source) DO UPDATE SET "
+			"newest_modify_date=excluded.newest_modify_date, last_synced=excluded.last_synced, "
+			"checkpoint_query=excluded.checkpoint_query, checkpoint_page=excluded.checkpoint_page, "
+			"checkpoint_total_items=excluded.checkpoint_total_items, "
+			"checkpoint_modify_date=excluded.checkpoint_modify_date;"
+		};
+		return _execute_each<sync_state>(sql, "set_sync_state", {state},
+			[](sqlite3_stmt *stmt, const sync_state& s){
+				int rc = sqlite3_bind_text(stmt, 1, s.remote_source.c_str(), s.remote_source.size(), SQLITE_TRANSIENT);
+				if(rc == SQLITE_OK)
+					rc = sqlite3_bind_text(stmt, 2, s.newest_modify_date.c_str(), s.newest_modify_date.size(), SQLITE_TRANSIENT);
+				if(rc == SQLITE_OK)
+					rc = sqlite3_bind_int64(stmt, 3, s.last_synced);
+				if(rc == SQLITE_OK)
+					rc = sqlite3_bind_text(stmt, 4, s.checkpoint.query.c_str(), s.checkpoint.query.size(), SQLITE_TRANSIENT);
+				if(rc == SQLITE_OK)
+					rc = sqlite3_bind_int(stmt, 5, s.checkpoint.page);
+				if(rc == SQLITE_OK)
+					rc = sqlite3_bind_int(stmt, 6, s.checkpoint.total_items);
+				if(rc == SQLITE_OK)
+					rc = sqlite3_bind_text(stmt, 7, s.checkpoint.newest_modify_date.c_str(), s.checkpoint.newest_modify_date.size(), SQLITE_TRANSIENT);
+				return rc;
+			},
+			params
+		);
+	}
+
+
+	error update_package_info(
+		const package::info_list& packages,
+		const params& params
+	){
+		string sql{
+			"UPDATE " + params.table_name + " SET "
+			"asset_id=?, type=?, title=?, author=?, author_id=?, version=?, "
+			"godot_version=?, cost=?, description=?, modify_date=?, "
+			"support_level=?, category=?, remote_source=?, download_url=?, "
+			"download_hash=?, is_installed=?, install_path=? "
+			// "dependencies=? "
+			"WHERE title=? AND asset_id=?;"
+		};
+		return _execute_each<package::info>(sql, "update_package_info", packages,
+			[](sqlite3_stmt *stmt, const package::info& p){
+				int rc = _bind_package_info(stmt, p);
+				if(rc == SQLITE_OK)
+					rc = sqlite3_bind_text(stmt, 18, p.title.c_str(), p.title.size(), SQLITE_TRANSIENT);
+				if(rc == SQLITE_OK)
+					rc = sqlite3_bind_int64(stmt, 19, p.asset_id);
+				return rc;
+			},
+			params
+		);
+	}
+
+
+	error delete_packages(
+		const package::title_list& package_titles,
+		const params& params
+	){
+		string sql{"DELETE FROM " + params.table_name + " WHERE title=?;"};
+		return _execute_each<string>(sql, "delete_packages", package_titles,
+			[](sqlite3_stmt *stmt, const string& p_title){
+				return sqlite3_bind_text(stmt, 1, p_title.c_str(), p_title.size(), SQLITE_TRANSIENT);
+			},
+			params
+		);
+	}
+
+
+	error delete_packages(
+		const package::id_list& package_ids,
+		const params& params
+	){
+		string sql{"DELETE FROM " + params.table_name + " WHERE asset_id=?;"};
+		return _execute_each<size_t>(sql, "delete_packages", package_ids,
+			[](sqlite3_stmt *stmt, const size_t& p_id){
+				return sqlite3_bind_int64(stmt, 1, p_id);
+			},
+			params
+		);
 	}
 
 
 	error drop_package_database(const params& params){
-		sqlite3 *db;
-		sqlite3_stmt *res;
-		char *errmsg = nullptr;
-		string sql{"DROP TABLE IF EXISTS " + params.table_name + ";\n"};
+		database& db = get_database(params);
+		std::lock_guard lock(db.get_mutex());
 
-		int rc = sqlite3_open(params.cache_path.c_str(), &db);
-		if(rc != SQLITE_OK){
-			error error(ec::SQLITE_ERR, std::format(
-				"cache::drop_package_database::sqlite3_open(): {}", sqlite3_errmsg(db)
-			));
-			sqlite3_close(db);
-			return error;
+		/* Forget the applied migrations too so that the next call to
+		create_package_database() rebuilds the table with its indexes. */
+		error error = _create_schema_table(db);
+		if(!error.has_occurred()){
+			error = db.exec(
+				"DROP TABLE IF EXISTS " + params.table_name + "_fts;\n"
+				"DROP TABLE IF EXISTS " + params.table_name + "_sync;\n"
+				"DROP TABLE IF EXISTS " + params.table_name + "_staging;\n"
+				"DROP TABLE IF EXISTS " + params.table_name + ";\n"
+				"DELETE FROM " GDPM_PACKAGE_CACHE_SCHEMA_TABLENAME " WHERE table_name='" + _escape_sql(params.table_name) + "';"
+			);
 		}
-		
-		rc = sqlite3_exec(db, sql.c_str(), nullptr, nullptr, &errmsg);
-		if(rc != SQLITE_OK){
-			error error(ec::SQLITE_ERR, std::format(
-				"cache::drop_package_database::sqlite3_exec(): {}", errmsg
+		if(error.has_occurred()){
+			error.set_message(std::format(
+				"cache::drop_package_database(): {}",
+				error.get_message()
 			));
-			sqlite3_free(errmsg);
-			sqlite3_close(db);
-			return error;
 		}
-
-		return error();
+		return error;
 	}
 
 
@@ -505,4 +1249,4 @@ namespace gdpm::cache{
 		return result_t(o, error());
 	}
 
-}
\ No newline at end of file
+}
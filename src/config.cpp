@@ -65,6 +65,10 @@ namespace gdpm::config{
 			+ prefix + "\"remote_sources\":" + spaces + utils::json::from_object(config.remote_sources, prefix, spaces) + ","
 			+ prefix + "\"threads\":" + spaces + fmt::to_string(config.jobs) + ","
 			+ prefix + "\"timeout\":" + spaces + fmt::to_string(config.timeout) + ","
+			+ prefix + "\"busy_timeout\":" + spaces + fmt::to_string(config.busy_timeout) + ","
+			+ prefix + "\"sync_ttl\":" + spaces + fmt::to_string(config.sync_ttl) + ","
+			+ prefix + "\"max_host_streams\":" + spaces + fmt::to_string(config.max_host_streams) + ","
+			+ prefix + "\"max_host_rate\":" + spaces + fmt::to_string(config.max_host_rate) + ","
 			+ prefix + "\"enable_sync\":" + spaces + fmt::to_string(config.enable_sync) + ","
 			+ prefix + "\"enable_file_logging\":" + spaces + fmt::to_string(config.enable_file_logging)
 			+ "\n}"
@@ -162,6 +166,14 @@ namespace gdpm::config{
 			config.packages_dir 		= _get_value_string(doc, "packages_dir");
 			config.tmp_dir 				= _get_value_string(doc, "tmp_dir");
 			config.jobs 				= _get_value_int(doc, "threads");
+			if(doc.HasMember("busy_timeout"))
+				config.busy_timeout		= _get_value_int(doc, "busy_timeout");
+			if(doc.HasMember("sync_ttl"))
+				config.sync_ttl			= _get_value_int(doc, "sync_ttl");
+			if(doc.HasMember("max_host_streams"))
+				config.max_host_streams	= _get_value_int(doc, "max_host_streams");
+			if(doc.HasMember("max_host_rate"))
+				config.max_host_rate	= _get_value_int(doc, "max_host_rate");
 			config.enable_sync 			= _get_value_int(doc, "enable_sync");
 			config.enable_file_logging 	= _get_value_int(doc, "enable_file_logging");
 		}
@@ -254,7 +266,11 @@ namespace gdpm::config{
 		else if(property == "remote-sources")		log::println("use 'gpdm remote' to manage remotes");
 		else if(property == "jobs")					config.jobs				= std::stoi(value);
 		else if(property == "timeout")				config.timeout			= std::stoi(value);
+		else if(property == "busy-timeout")			config.busy_timeout		= std::stoi(value);
 		else if(property == "enable-sync")			config.enable_sync		= utils::to_bool(value);
+		else if(property == "sync-ttl")				config.sync_ttl			= std::stoi(value);
+		else if(property == "max-host-streams")		config.max_host_streams	= std::stoi(value);
+		else if(property == "max-host-rate")		config.max_host_rate	= std::stoi(value);
 		else if(property == "enable-cache")			config.enable_cache		= utils::to_bool(value);
 		else if(property == "skip-prompt")			config.skip_prompt		= utils::to_bool(value);
 		else if(property == "enable-file-logging")	config.enable_file_logging	= utils::to_bool(value);
@@ -284,7 +300,11 @@ namespace gdpm::config{
 		else if(property == "remote-sources") return utils::join(config.remote_sources);
 		else if(property == "jobs")			return config.jobs;
 		else if(property == "timeout")		return config.timeout;
+		else if(property == "busy-timeout")	return config.busy_timeout;
 		else if(property == "sync")			return config.enable_sync;
+		else if(property == "sync-ttl")		return config.sync_ttl;
+		else if(property == "max-host-streams") return config.max_host_streams;
+		else if(property == "max-host-rate") return config.max_host_rate;
 		else if(property == "cache")		return config.enable_cache;
 		else if(property == "skip-prompt")	return config.skip_prompt;
 		else if(property == "file-logging") return config.enable_file_logging;
@@ -367,7 +387,11 @@ namespace gdpm::config{
 		else if(property == "remote-sources") 	log::println("remote sources: \n{}", utils::join(config.remote_sources, "\t", "\n"));
 		else if(property == "jobs") 			log::println("parallel jobs: {}", config.jobs);
 		else if(property == "timeout") 			log::println("timeout: {}", config.timeout);
+		else if(property == "busy-timeout") 	log::println("cache busy timeout: {}", config.busy_timeout);
 		else if(property == "sync") 			log::println("enable sync: {}", config.enable_sync);
+		else if(property == "sync-ttl") 		log::println("sync ttl: {}", config.sync_ttl);
+		else if(property == "max-host-streams") log::println("max streams per host: {}", config.max_host_streams);
+		else if(property == "max-host-rate") 	log::println("max requests per second per host: {}", config.max_host_rate);
 		else if(property == "cache") 			log::println("enable cache: {}", config.enable_cache);
 		else if(property == "skip-prompt") 		log::println("skip prompt: {}", config.skip_prompt);
 		else if(property == "logging") 			log::println("enable file logging: {}", config.enable_file_logging);
@@ -392,7 +416,11 @@ namespace gdpm::config{
 		else if(property == "remote-sources") 	table.add_row({"Remotes", utils::join(config.remote_sources, "\t", "\n")});
 		else if(property == "jobs") 			table.add_row({"Threads", std::to_string(config.jobs)});
 		else if(property == "timeout") 			table.add_row({"Timeout", std::to_string(config.timeout)});
+		else if(property == "busy-timeout") 	table.add_row({"Busy Timeout", std::to_string(config.busy_timeout)});
 		else if(property == "sync") 			table.add_row({"Fetch Assets", std::to_string(config.enable_sync)});
+		else if(property == "sync-ttl") 		table.add_row({"Sync TTL", std::to_string(config.sync_ttl)});
+		else if(property == "max-host-streams") table.add_row({"Max Host Streams", std::to_string(config.max_host_streams)});
+		else if(property == "max-host-rate") 	table.add_row({"Max Host Rate", std::to_string(config.max_host_rate)});
 		else if(property == "cache") 			table.add_row({"Cache", std::to_string(config.enable_cache)});
 		else if(property == "skip-prompt") 		table.add_row({"Skip Prompt", std::to_string(config.skip_prompt)});
 		else if(property == "logging") 			table.add_row({"File Logging", std::to_string(config.enable_file_logging)});
@@ -418,7 +446,11 @@ namespace gdpm::config{
 				_print_property(config, "remote-sources");
 				_print_property(config, "jobs");
 				_print_property(config, "timeout");
+				_print_property(config, "busy-timeout");
 				_print_property(config, "sync");
+				_print_property(config, "sync-ttl");
+				_print_property(config, "max-host-streams");
+				_print_property(config, "max-host-rate");
 				_print_property(config, "cache");
 				_print_property(config, "prompt");
 				_print_property(config, "logging");
@@ -449,7 +481,11 @@ namespace gdpm::config{
 				table.add_row({"Remotes", utils::join(config.remote_sources)});
 				table.add_row({"Threads", std::to_string(config.jobs)});
 				table.add_row({"Timeout", std::to_string(config.timeout)});
+				table.add_row({"Busy Timeout", std::to_string(config.busy_timeout)});
 				table.add_row({"Fetch Data", std::to_string(config.enable_sync)});
+				table.add_row({"Sync TTL", std::to_string(config.sync_ttl)});
+				table.add_row({"Max Host Streams", std::to_string(config.max_host_streams)});
+				table.add_row({"Max Host Rate", std::to_string(config.max_host_rate)});
 				table.add_row({"Use Cache", std::to_string(config.enable_cache)});
 				table.add_row({"Logging", std::to_string(config.enable_file_logging)});
 				table.add_row({"Clean", std::to_string(config.clean_temporary)});
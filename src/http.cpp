@@ -8,26 +8,562 @@
 #include <curl/curl.h>
 #include <curl/easy.h>
 #include <curl/multi.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
 #include <memory>
+#include <mutex>
 #include <stdio.h>
 #include <chrono>
+#include <cmath>
+#include <ctime>
+#include <deque>
+#include <random>
+#include <thread>
 #include <type_traits>
+#include <vector>
 
 
 namespace gdpm::http{
 
-	context::context(int max_transfers): max_transfers(max_transfers){
+	std::mutex _share_mutex;
+	std::mutex _share_locks[CURL_LOCK_DATA_LAST];
+	CURLSH *_share = nullptr;
+	std::vector<CURL*> _idle_handles;
+	settings _settings;
+
+
+	void _lock_share(CURL *curl, curl_lock_data data, curl_lock_access access, void *userptr){
+		_share_locks[data].lock();
+	}
+
+
+	void _unlock_share(CURL *curl, curl_lock_data data, void *userptr){
+		_share_locks[data].unlock();
+	}
+
+
+	void _prepare_handle(CURL *curl){
+		curl_easy_setopt(curl, CURLOPT_SHARE, _share);
+		curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+		/* Use HTTP/2 when the server offers it over TLS and wait for an
+		existing connection to multiplex on instead of opening another. */
+		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+		curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+	}
+
+
+	void _set_encoding(CURL *eh, const http::request& params){
+		/* An empty string makes libcurl send an Accept-Encoding header with
+		every encoding it can decode, and decode the body while writing it. */
+		if(params.compress)
+			curl_easy_setopt(eh, CURLOPT_ACCEPT_ENCODING, "");
+	}
+
+
+	void _get_sizes(CURL *eh, response& r){
+		curl_off_t bytes = 0;
+		curl_easy_getinfo(eh, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+		r.bytes_received = bytes;
+		r.bytes_decoded = (curl_off_t)r.body.size();
+	}
+
+
+	/* Receives a response body straight into the string that is returned.
+	The first chunk reserves the Content-Length when the server sent one,
+	and std::string grows geometrically otherwise, so even large pages take
+	a constant number of allocations. */
+	size_t _write_to_body(
+		char *contents,
+		size_t size,
+		size_t nmemb,
+		void *userdata
+	){
+		_body_sink *sink = (_body_sink*)userdata;
+		size_t realsize = size * nmemb;
+		if(!sink->is_sized){
+			sink->is_sized = true;
+			curl_off_t length = -1;
+			curl_easy_getinfo(sink->eh, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+			size_t expected = (length > 0) ? (size_t)length : (size_t)CURL_MAX_WRITE_SIZE;
+			sink->body->reserve(std::max(expected, sink->body->size() + realsize));
+		}
+		sink->body->append(contents, realsize);
+		return realsize;
+	}
+
+
+	/* Token bucket per host for `max_host_rate`. `blocked_until` is pushed
+	back whenever the host asks us to slow down with 429 or 503. */
+	struct _host_limit{
+		double tokens				= -1.0;
+		std::chrono::steady_clock::time_point refilled;
+		std::chrono::steady_clock::time_point blocked_until;
+	};
+	std::mutex _hosts_mutex;
+	std::unordered_map<string, _host_limit> _hosts;
+
+
+	string _get_host(const string& url){
+		string host;
+		CURLU *u = curl_url();
+		char *h = nullptr;
+		if(curl_url_set(u, CURLUPART_URL, url.c_str(), 0) == CURLUE_OK &&
+			curl_url_get(u, CURLUPART_HOST, &h, 0) == CURLUE_OK){
+			host = h;
+			curl_free(h);
+		}
+		curl_url_cleanup(u);
+		return host;
+	}
+
+
+	/* Takes a token for `host` and returns 0, or returns how long to wait
+	before asking again. */
+	std::chrono::milliseconds _acquire_host(const string& host){
+		using namespace std::chrono;
+		std::lock_guard lock(_hosts_mutex);
+		_host_limit& h = _hosts[host];
+		auto now = steady_clock::now();
+		if(now < h.blocked_until)
+			return duration_cast<milliseconds>(h.blocked_until - now) + 1ms;
+
+		const double rate = _settings.max_host_rate;
+		if(rate <= 0.0)
+			return 0ms;
+		const double burst = std::max(rate, 1.0);
+		if(h.tokens < 0.0)
+			h.tokens = burst;
+		else
+			h.tokens = std::min(burst, h.tokens + duration<double>(now - h.refilled).count() * rate);
+		h.refilled = now;
+		if(h.tokens >= 1.0){
+			h.tokens -= 1.0;
+			return 0ms;
+		}
+		return milliseconds((long)std::ceil((1.0 - h.tokens) / rate * 1000.0));
+	}
+
+
+	void _wait_for_host(const string& host){
+		for(auto wait = _acquire_host(host); wait.count() > 0; wait = _acquire_host(host))
+			std::this_thread::sleep_for(wait);
+	}
+
+
+	bool _is_throttled(long code){
+		return code == TOO_MANY_REQUESTS || code == SERVICE_UNAVAILABLE;
+	}
+
+
+	bool _is_congested(long code, CURLcode result){
+		return _is_throttled(code) 
+			|| result == CURLE_OPERATION_TIMEDOUT
+			|| result == CURLE_COULDNT_CONNECT
+			|| result == CURLE_SEND_ERROR
+			|| result == CURLE_RECV_ERROR;
+	}
+
+
+	/* Reads `Retry-After` as either seconds or an HTTP date, and otherwise
+	backs off exponentially with each attempt. */
+	long _get_retry_after(const headers_t& headers, int attempt){
+		long seconds = -1;
+		auto it = headers.find("retry-after");
+		if(it != headers.end() && !it->second.empty()){
+			if(std::all_of(it->second.begin(), it->second.end(), ::isdigit)){
+				try{ seconds = std::stol(it->second); }
+				catch(...){ seconds = GDPM_HTTP_MAX_RETRY_AFTER_S; }
+			}
+			else{
+				time_t date = curl_getdate(it->second.c_str(), nullptr);
+				if(date >= 0)
+					seconds = std::max<long>(date - std::time(nullptr), 0);
+			}
+		}
+		if(seconds < 0)
+			seconds = 1L << std::clamp(attempt - 1, 0, 6);
+		return std::min<long>(seconds, GDPM_HTTP_MAX_RETRY_AFTER_S);
+	}
+
+
+	void _throttle_host(const string& host, const headers_t& headers, int attempt){
+		using namespace std::chrono;
+		long seconds = _get_retry_after(headers, attempt);
+		log::debug("http: throttled by {}, waiting {}s", host, seconds);
+
+		std::lock_guard lock(_hosts_mutex);
+		_host_limit& h = _hosts[host];
+		h.blocked_until = std::max(h.blocked_until, steady_clock::now() + std::chrono::seconds(seconds));
+	}
+
+
+	bool retry_policy::should_retry(long code, CURLcode result) const{
+		if(std::find(retry_codes.begin(), retry_codes.end(), code) != retry_codes.end())
+			return true;
+		if(retry_server_errors && code >= INTERNAL_SERVER_ERROR 
+			&& code != NOT_IMPLEMENTED && code != HTTP_VERSION_NOT_SUPPORTED)
+			return true;
+		if(!retry_transport_errors)
+			return false;
+		switch(result){
+			case CURLE_COULDNT_RESOLVE_HOST:
+			case CURLE_COULDNT_CONNECT:
+			case CURLE_OPERATION_TIMEDOUT:
+			case CURLE_SSL_CONNECT_ERROR:
+			case CURLE_GOT_NOTHING:
+			case CURLE_SEND_ERROR:
+			case CURLE_RECV_ERROR:
+			case CURLE_PARTIAL_FILE:
+			case CURLE_HTTP2:
+			case CURLE_HTTP2_STREAM:
+				return true;
+			default:
+				return false;
+		}
+	}
+
+
+	std::chrono::milliseconds retry_policy::get_delay(int attempt) const{
+		thread_local std::mt19937 rng{std::random_device{}()};
+		double delay = std::min<double>(
+			max_delay.count(),
+			base_delay.count() * std::pow(2.0, std::clamp(attempt - 1, 0, 30))
+		);
+		double spread = delay * std::clamp(jitter, 0.0, 1.0);
+		std::uniform_real_distribution<double> dist(0.0, spread);
+		return std::chrono::milliseconds((long)(delay - spread + dist(rng)));
+	}
+
+
+	bool _can_retry(const http::request& params, long code, CURLcode result){
+		return params.method == method::GET && params.retry.should_retry(code, result);
+	}
+
+
+	/* URLs waiting to be started by a multi transfer loop. `pop()` skips
+	URLs that are backing off or whose host is rate limited, and leaves in
+	`wait` how long until the first of them can go. */
+	struct _transfer_queue{
+		std::deque<size_t> pending;
+		string_list hosts;
+		std::vector<int> throttled;
+		std::vector<int> failures;
+		std::vector<std::chrono::steady_clock::time_point> not_before;
+		std::chrono::milliseconds wait{0};
+
+		_transfer_queue(const string_list& urls):
+			hosts(urls.size()), 
+			throttled(urls.size(), 0), 
+			failures(urls.size(), 0), 
+			not_before(urls.size())
+		{
+			for(size_t i = 0; i < urls.size(); i++){
+				pending.emplace_back(i);
+				hosts[i] = _get_host(urls[i]);
+			}
+		}
+
+		bool empty() const { return pending.empty(); }
+
+		bool pop(size_t& index){
+			using namespace std::chrono;
+			auto now = steady_clock::now();
+			wait = milliseconds(1000);
+			for(auto it = pending.begin(); it != pending.end(); ++it){
+				if(now < not_before[*it]){
+					wait = std::min(wait, duration_cast<milliseconds>(not_before[*it] - now) + 1ms);
+					continue;
+				}
+				auto delay = _acquire_host(hosts[*it]);
+				if(delay.count() == 0){
+					index = *it;
+					pending.erase(it);
+					return true;
+				}
+				wait = std::min(wait, delay);
+			}
+			return false;
+		}
+
+		/* Puts a failed URL back to be tried again, after its host's
+		backoff when it was throttled or after the policy's delay otherwise.
+		Returns false once it has been tried too often. */
+		bool retry(size_t index, long code, CURLcode result, const headers_t& headers, const http::request& params){
+			if(_is_throttled(code)){
+				throttled[index] += 1;
+				_throttle_host(hosts[index], headers, throttled[index]);
+				if(throttled[index] > GDPM_HTTP_MAX_THROTTLED_RETRIES)
+					return false;
+			}
+			else if(_can_retry(params, code, result)){
+				failures[index] += 1;
+				if(failures[index] >= params.retry.max_attempts)
+					return false;
+				auto delay = params.retry.get_delay(failures[index]);
+				log::debug("http: retrying request {} in {}ms", index, delay.count());
+				not_before[index] = std::chrono::steady_clock::now() + delay;
+			}
+			else{
+				return false;
+			}
+			pending.emplace_back(index);
+			return true;
+		}
+	};
+
+
+	/* Each cached response is a single file named after a hash of its URL.
+	The file holds the URL, the ETag and Last-Modified validators, then the
+	body. */
+	std::mutex _cache_mutex;
+
+	/* Approximate size of the cache directory so it's only scanned once it
+	may have grown past the limit. -1 until the first scan. */
+	std::int64_t _cache_size = -1;
+
+
+	string _cache_path(const string& url){
+		/* FNV-1a, so names stay the same between builds */
+		std::uint64_t hash = 14695981039346656037ull;
+		for(unsigned char c : url){
+			hash ^= c;
+			hash *= 1099511628211ull;
+		}
+		return std::format("{}/{:016x}", _settings.cache_dir, hash);
+	}
+
+
+	bool _cache_load(const string& url, _cache_entry& entry){
+		if(_settings.cache_max_size == 0)
+			return false;
+
+		std::ifstream ifs(_cache_path(url), std::ios::binary);
+		string cached_url;
+		if(!ifs || !std::getline(ifs, cached_url) || cached_url != url)
+			return false;
+		std::getline(ifs, entry.etag);
+		std::getline(ifs, entry.last_modified);
+		entry.body.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+		return true;
+	}
+
+
+	/* Called with `_cache_mutex` held */
+	void _cache_evict(){
+		namespace fs = std::filesystem;
+		std::error_code ec;
+		std::vector<std::pair<fs::file_time_type, fs::path>> files;
+		size_t total = 0;
+		for(const auto& f : fs::directory_iterator(_settings.cache_dir, ec)){
+			if(!f.is_regular_file(ec) || f.path().extension() == ".tmp")
+				continue;
+			total += f.file_size(ec);
+			files.emplace_back(f.last_write_time(ec), f.path());
+		}
+		_cache_size = total;
+		if(total <= _settings.cache_max_size)
+			return;
+
+		/* Hits refresh the write time, so the oldest files are the least
+		recently used. */
+		std::sort(files.begin(), files.end());
+		for(const auto& [time, path] : files){
+			if(total <= _settings.cache_max_size)
+				break;
+			size_t size = fs::file_size(path, ec);
+			if(fs::remove(path, ec))
+				total -= std::min(size, total);
+		}
+		_cache_size = total;
+	}
+
+
+	/* Responses the server marked as not to be kept, or only by the user's
+	own browser, never go in the shared cache. */
+	bool _is_storable(const headers_t& headers){
+		auto it = headers.find("cache-control");
+		if(it == headers.end())
+			return true;
+		string value = utils::to_lower(it->second);
+		return value.find("no-store") == string::npos && value.find("private") == string::npos;
+	}
+
+
+	void _cache_store(const string& url, const response& r){
+		auto etag = r.headers.find("etag");
+		auto last_modified = r.headers.find("last-modified");
+		bool has_validators = etag != r.headers.end() || last_modified != r.headers.end();
+		if(_settings.cache_max_size == 0 || !has_validators || r.body.size() > _settings.cache_max_size)
+			return;
+		if(!_is_storable(r.headers))
+			return;
+
+		/* Write to a temporary file first so readers never see a partial
+		entry. */
+		std::error_code ec;
+		std::filesystem::create_directories(_settings.cache_dir, ec);
+		string path = _cache_path(url);
+		string tmp_path = std::format("{}.{}.tmp", path, std::hash<std::thread::id>()(std::this_thread::get_id()));
+		std::int64_t size = 0;
+		{
+			std::ofstream ofs(tmp_path, std::ios::binary | std::ios::trunc);
+			if(!ofs)
+				return;
+			ofs << url << "\n"
+				<< ((etag != r.headers.end()) ? etag->second : "") << "\n"
+				<< ((last_modified != r.headers.end()) ? last_modified->second : "") << "\n";
+			ofs.write(r.body.data(), r.body.size());
+			size = (std::int64_t)ofs.tellp();
+		}
+		std::lock_guard lock(_cache_mutex);
+		std::int64_t replaced = (std::int64_t)std::filesystem::file_size(path, ec);
+		if(ec)
+			replaced = 0;
+		std::filesystem::rename(tmp_path, path, ec);
+		if(ec){
+			std::filesystem::remove(tmp_path, ec);
+			return;
+		}
+		if(_cache_size >= 0)
+			_cache_size += size - replaced;
+		if(_cache_size < 0 || _cache_size > (std::int64_t)_settings.cache_max_size)
+			_cache_evict();
+	}
+
+
+	/* Adds the validators of a cached entry so the server can answer with
+	304 NOT_MODIFIED instead of sending the body again. */
+	headers_t _cache_headers(const headers_t& headers, const _cache_entry& entry){
+		headers_t h = headers;
+		if(!entry.etag.empty())
+			h.insert_or_assign("If-None-Match", entry.etag);
+		if(!entry.last_modified.empty())
+			h.insert_or_assign("If-Modified-Since", entry.last_modified);
+		return h;
+	}
+
+
+	void _cache_update(const string& url, response& r, const _cache_entry *entry){
+		if(r.code == NOT_MODIFIED && entry != nullptr){
+			/* Nothing but the headers came over the network */
+			r.code = OK;
+			r.body = entry->body;
+			r.bytes_decoded = (curl_off_t)r.body.size();
+			r.from_cache = true;
+			std::error_code ec;
+			std::filesystem::last_write_time(_cache_path(url), std::filesystem::file_time_type::clock::now(), ec);
+		}
+		else if(r.code == OK){
+			_cache_store(url, r);
+		}
+	}
+
+
+	void _initialize_share(){
+		std::lock_guard lock(_share_mutex);
+		if(_share != nullptr)
+			return;
+
 		curl_global_init(CURL_GLOBAL_ALL);
-		curl = curl_easy_init();
+		_share = curl_share_init();
+		curl_share_setopt(_share, CURLSHOPT_LOCKFUNC, _lock_share);
+		curl_share_setopt(_share, CURLSHOPT_UNLOCKFUNC, _unlock_share);
+		curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+		/* Connections aren't shared since contexts run on several threads
+		at once, which libcurl doesn't support for a shared connection
+		cache. They stay with each multi handle or pooled easy handle. */
+	}
+
+
+	void initialize(const settings& settings){
+		{
+			std::lock_guard lock(_share_mutex);
+			_settings = settings;
+		}
+		{
+			/* The cache directory may have changed, so scan it again */
+			std::lock_guard lock(_cache_mutex);
+			_cache_size = -1;
+		}
+		_initialize_share();
+	}
+
+
+	void cleanup(){
+		std::lock_guard lock(_share_mutex);
+		if(_share == nullptr)
+			return;
+
+		for(CURL *curl : _idle_handles)
+			curl_easy_cleanup(curl);
+		_idle_handles.clear();
+		CURLSHcode code = curl_share_cleanup(_share);
+		if(code != CURLSHE_OK){
+			log::debug("http::cleanup(): curl_share_cleanup(): {}", curl_share_strerror(code));
+		}
+		_share = nullptr;
+		curl_global_cleanup();
+	}
+
+
+	CURL* acquire_handle(){
+		_initialize_share();
+		CURL *curl = nullptr;
+		{
+			std::lock_guard lock(_share_mutex);
+			if(!_idle_handles.empty()){
+				curl = _idle_handles.back();
+				_idle_handles.pop_back();
+			}
+		}
+		if(curl == nullptr)
+			curl = curl_easy_init();
+		if(curl != nullptr)
+			_prepare_handle(curl);
+		return curl;
+	}
+
+
+	void release_handle(CURL *curl){
+		if(curl == nullptr)
+			return;
+
+		/* Resetting clears the options from the last transfer, but keeps the
+		connections and caches that make reusing the handle worthwhile. */
+		curl_easy_reset(curl);
+		std::lock_guard lock(_share_mutex);
+		if(_share == nullptr){
+			curl_easy_cleanup(curl);
+			return;
+		}
+		_idle_handles.emplace_back(curl);
+	}
+
+
+	context::context(int max_transfers): max_transfers(max_transfers){
+		_initialize_share();
+		curl = acquire_handle();
 		cm = curl_multi_init();
+		curl_multi_setopt(cm, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+		curl_multi_setopt(cm, CURLMOPT_MAX_CONCURRENT_STREAMS, _settings.max_host_streams);
 		set_max_transfers(max_transfers);
 	}
 
 
 	context::~context(){
-		curl_easy_cleanup(curl);
+		release_handle(curl);
 		curl_multi_cleanup(cm);
-		curl_global_cleanup();
 	}
 
 
@@ -41,11 +577,18 @@ namespace gdpm::http{
 		const http::request& params
 	){
 		CURLcode res;
-		utils::memory_buffer buf = utils::make_buffer();
-		utils::memory_buffer data = utils::make_buffer();
 		response r;
+		r.body = _acquire_buffer();
+		_body_sink sink{ .body = &r.body, .eh = curl };
+		_cache_entry entry;
+		bool use_cache = params.use_cache && params.method == method::GET;
+		bool is_cached = use_cache && _cache_load(url, entry);
 		if(curl){
-			curl_slist *list = add_headers(curl, params.headers);
+			curl_easy_reset(curl);
+			_prepare_handle(curl);
+			curl_slist *list = add_headers(curl, 
+				(is_cached) ? _cache_headers(params.headers, entry) : params.headers
+			);
 			if(params.method == method::POST){
 				string h;
 				std::for_each(
@@ -64,23 +607,43 @@ namespace gdpm::http{
 				curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "GET");
 			}
 			curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-			curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&buf);
-			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_to_buffer);
+			_set_encoding(curl, params);
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&sink);
+			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, _write_to_body);
+			curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void*)&r.headers);
+			curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, write_to_headers);
 			curl_easy_setopt(curl, CURLOPT_NOPROGRESS, false);
-			curl_easy_setopt(curl, CURLOPT_XFERINFODATA, (void*)&data);
 			curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, show_download_progress);
 			curl_easy_setopt(curl, CURLOPT_USERAGENT, constants::UserAgent.c_str());
 			curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, params.timeout);
-			res = curl_easy_perform(curl);
+			const string host = _get_host(url);
+			for(int attempt = 1;; attempt++){
+				_wait_for_host(host);
+				res = curl_easy_perform(curl);
+				curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &r.code);
+				if(_is_throttled(r.code) && attempt <= GDPM_HTTP_MAX_THROTTLED_RETRIES){
+					_throttle_host(host, r.headers, attempt);
+				}
+				else if(_can_retry(params, r.code, res) && attempt < params.retry.max_attempts){
+					auto delay = params.retry.get_delay(attempt);
+					log::debug("http::context::request(): retrying <url: {}> in {}ms", url, delay.count());
+					std::this_thread::sleep_for(delay);
+				}
+				else{
+					break;
+				}
+				r.body.clear();
+				sink.is_sized = false;
+				r.headers.clear();
+			}
 			curl_slist_free_all(list);
-			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &r.code);
+			_get_sizes(curl, r);
 			if(res != CURLE_OK && params.verbose > 0)
-				log::error("http::context::request::curl_easy_perform(): {}", (long)curl_easy_strerror(res));
-			curl_easy_cleanup(curl);
+				log::error("http::context::request::curl_easy_perform(): {}", curl_easy_strerror(res));
 		}
 
-		r.body = buf.addr;
-		utils::free_buffer(buf);
+		if(use_cache)
+			_cache_update(url, r, (is_cached) ? &entry : nullptr);
 		return r;
 	}
 
@@ -88,273 +651,582 @@ namespace gdpm::http{
 	responses context::requests(
 		const string_list& urls, 
 		const http::request& params
+	){
+		responses r(urls.size());
+		requests(urls,
+			[&r](size_t i, response& response){
+				r[i] = std::move(response);
+			},
+			params
+		);
+		return r;
+	}
+
+
+	std::future<responses> context::requests_async(
+		const string_list& urls,
+		const http::request& params
+	){
+		/* Handles can't be used from two threads at once, so the request runs
+		in its own context. Connections still come from the shared pool. */
+		return std::async(std::launch::async,
+			[urls, params, max_transfers = max_transfers](){
+				context http(max_transfers);
+				return http.requests(urls, params);
+			}
+		);
+	}
+
+
+	error context::requests(
+		const string_list& urls,
+		const response_callback& on_response,
+		const http::request& params
 	){
 		if(cm == nullptr){
-			log::error(error(ec::PRECONDITION_FAILED, 
-				"http::multi::make_downloads(): multi client not initialized.")
-			);
+			return log::error_rc(error(ec::PRECONDITION_FAILED,
+				"http::context::requests(): multi client not initialized."
+			));
 		}
-		if(urls.size() <= 0){
-			log::warn("No requests to make.");
-		}
-		transfers_left = urls.size();
-		transfers_index = 0;
-
-		auto add_transfer = [this](const string& url, const http::request& params)-> void {
-			CURL *curl = curl_easy_init();
-			utils::memory_buffer *data;
-			if(curl){
-				curl_slist *list = add_headers(curl, params.headers);
-				if(params.method == method::POST){
-					string h;
-					std::for_each(
-						params.headers.begin(),
-						params.headers.end(),
-						[&h](const string_pair& kv){
-							h += kv.first + "=" + kv.second + "&";
-						}
-						
-					);
-					h.pop_back();
-					h = url_escape(h);
-					curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, h.size());
-					curl_easy_setopt(curl, CURLOPT_POSTFIELDS, h.c_str());
+
+		/* Keep up to the congestion window of handles in the multi handle
+		and add the next URL as soon as one finishes, so a slow response
+		never holds up the others. A hedged URL has a second transfer at
+		`urls.size() + index`, and whichever of the two finishes first is
+		kept. */
+		struct transfer{
+			size_t index				= 0;
+			CURL *eh					= nullptr;
+			curl_slist *list			= nullptr;
+			string body;
+			_body_sink sink;
+			headers_t headers;
+			_cache_entry entry;
+			bool is_cached				= false;
+			bool is_hedged				= false;
+			std::chrono::steady_clock::time_point started;
+		};
+		const bool use_cache = params.use_cache && params.method == method::GET;
+		const bool use_hedging = params.retry.hedge && params.method == method::GET;
+		const size_t count = urls.size();
+		std::vector<transfer> transfers(count * 2);
+		_transfer_queue queue(urls);
+		size_t running = 0;
+		error error;
+
+		auto add_transfer = [&](size_t i, size_t slot) -> bool {
+			transfer& t = transfers[slot];
+			t.index = i;
+			t.eh = acquire_handle();
+			if(t.eh == nullptr)
+				return false;
+			t.body = _acquire_buffer();
+			t.sink = _body_sink{ .body = &t.body, .eh = t.eh };
+			t.is_cached = use_cache && _cache_load(urls[i], t.entry);
+			t.list = add_headers(t.eh, 
+				(t.is_cached) ? _cache_headers(params.headers, t.entry) : params.headers
+			);
+			t.started = std::chrono::steady_clock::now();
+			curl_easy_setopt(t.eh, CURLOPT_URL, urls[i].c_str());
+			curl_easy_setopt(t.eh, CURLOPT_PRIVATE, &t);
+			_set_encoding(t.eh, params);
+			curl_easy_setopt(t.eh, CURLOPT_WRITEDATA, (void*)&t.sink);
+			curl_easy_setopt(t.eh, CURLOPT_WRITEFUNCTION, _write_to_body);
+			curl_easy_setopt(t.eh, CURLOPT_HEADERDATA, (void*)&t.headers);
+			curl_easy_setopt(t.eh, CURLOPT_HEADERFUNCTION, write_to_headers);
+			curl_easy_setopt(t.eh, CURLOPT_FOLLOWLOCATION, true);
+			curl_easy_setopt(t.eh, CURLOPT_USERAGENT, constants::UserAgent.c_str());
+			curl_easy_setopt(t.eh, CURLOPT_TIMEOUT_MS, params.timeout);
+			cres = curl_multi_add_handle(cm, t.eh);
+			if(cres != CURLM_OK){
+				log::error("http::context::requests(): curl_multi_add_handle(): {}", curl_multi_strerror(cres));
+				release_handle(t.eh);
+				curl_slist_free_all(t.list);
+				release_buffer(std::move(t.body));
+				t = transfer();
+				return false;
+			}
+			return true;
+		};
+		auto release_transfer = [&](transfer& t){
+			curl_multi_remove_handle(cm, t.eh);
+			release_handle(t.eh);
+			curl_slist_free_all(t.list);
+			release_buffer(std::move(t.body));
+			t = transfer();
+		};
+		auto finish_transfer = [&](transfer& t, CURLcode result){
+			response r;
+			curl_off_t bytes = 0;
+			const size_t index = t.index;
+			transfer& twin = transfers[(&t == &transfers[index]) ? count + index : index];
+			curl_easy_getinfo(t.eh, CURLINFO_RESPONSE_CODE, &r.code);
+			curl_easy_getinfo(t.eh, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+			bool is_failed = result != CURLE_OK || _is_throttled(r.code) || _can_retry(params, r.code, result);
+
+			/* Give the other transfer of a hedged pair a chance to succeed,
+			and cancel it once this one has. */
+			if(twin.eh != nullptr){
+				if(is_failed){
+					release_transfer(t);
+					return;
 				}
-				else if(params.method == method::GET){
-					curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "GET");
+				release_transfer(twin);
+			}
+			window.update(_is_congested(r.code, result), bytes);
+			if(!is_failed)
+				_record_latency(std::chrono::steady_clock::now() - t.started);
+			if(is_failed && queue.retry(index, r.code, result, t.headers, params)){
+				release_transfer(t);
+				running -= 1;
+				return;
+			}
+			if(result != CURLE_OK){
+				log::error("http::context::requests(): {} <url: {}>", curl_easy_strerror(result), urls[index]);
+			}
+			else{
+				r.body = std::move(t.body);
+				r.headers = std::move(t.headers);
+				_get_sizes(t.eh, r);
+				if(use_cache)
+					_cache_update(urls[index], r, (t.is_cached) ? &t.entry : nullptr);
+			}
+			release_transfer(t);
+			running -= 1;
+			on_response(index, r);
+
+			/* Keep the body's storage unless the callback took it */
+			release_buffer(std::move(r.body));
+		};
+
+		auto fill_transfers = [&](){
+			size_t i = 0;
+			while(running < window.get_limit() && queue.pop(i)){
+				if(add_transfer(i, i)){
+					running += 1;
+				}
+				else{
+					response r;
+					on_response(i, r);
 				}
-				curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-				curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void*)&data);
-				curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_to_buffer);
-				curl_easy_setopt(curl, CURLOPT_NOPROGRESS, false);
-				curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &data);
-				curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, show_download_progress);
-				curl_easy_setopt(curl, CURLOPT_USERAGENT, constants::UserAgent.c_str());
-				curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, params.timeout);
-			}
-			transfers_index += 1;
+			}
+		};
+
+		/* Starts a second copy of every request that has been running for
+		longer than the hedging percentile, and returns how long until the
+		next one would need it. */
+		auto hedge_transfers = [&]() -> std::chrono::milliseconds {
+			using namespace std::chrono;
+			milliseconds next(1000);
+			milliseconds delay = _get_hedge_delay(params.retry.hedge_percentile);
+			if(!use_hedging || delay.count() < 0)
+				return next;
+			auto now = steady_clock::now();
+			for(size_t i = 0; i < count; i++){
+				transfer& t = transfers[i];
+				if(t.eh == nullptr || t.is_hedged)
+					continue;
+				auto elapsed = duration_cast<milliseconds>(now - t.started);
+				if(elapsed < delay){
+					next = std::min(next, delay - elapsed);
+					continue;
+				}
+				if(_acquire_host(queue.hosts[i]).count() > 0)
+					continue;
+				t.is_hedged = true;
+				log::debug("http::context::requests(): hedging <url: {}> after {}ms", urls[i], elapsed.count());
+				add_transfer(i, count + i);
+			}
+			return next;
 		};
-		for(int i = 0; i < max_transfers; i++){
-			add_transfer(urls.at(i), params);
-		}
 
-		do{
-			int still_running = 1;
-			int numfds = 0;
+		fill_transfers();
+		while(running > 0 || !queue.empty()){
+			int still_running = 0;
 			cres = curl_multi_perform(cm, &still_running);
+			if(cres != CURLM_OK){
+				error = log::error_rc(ec::LIBCURL_ERR,
+					std::format("http::context::requests(): curl_multi_perform(): {}", curl_multi_strerror(cres))
+				);
+				break;
+			}
+
+			int messages_left = 0;
+			while((cmessage = curl_multi_info_read(cm, &messages_left))){
+				if(cmessage->msg != CURLMSG_DONE)
+					continue;
+				transfer *t = nullptr;
+				CURLcode result = cmessage->data.result;
+				curl_easy_getinfo(cmessage->easy_handle, CURLINFO_PRIVATE, &t);
+				finish_transfer(*t, result);
+			}
+			fill_transfers();
+			if(running == 0 && queue.empty())
+				break;
+
+			/* Wake up in time to start transfers held back by a rate limit
+			or a backoff, and to hedge slow ones. */
+			auto timeout = hedge_transfers();
+			if(!queue.empty())
+				timeout = std::min(timeout, queue.wait);
+			cres = curl_multi_poll(cm, NULL, 0, (int)timeout.count(), NULL);
+			if(cres != CURLM_OK){
+				error = log::error_rc(ec::LIBCURL_ERR,
+					std::format("http::context::requests(): curl_multi_poll(): {}", curl_multi_strerror(cres))
+				);
+				break;
+			}
+		}
+
+		/* Only reached with transfers left if the multi handle failed */
+		for(transfer& t : transfers){
+			if(t.eh != nullptr)
+				release_transfer(t);
+		}
+		return error;
+	}
+
+
+	/* Downloads are written to `<storage_path>.part` and resumed from its
+	size with a Range request. The part file is only renamed to the storage
+	path once its length, and hash when one is given, check out, so a file
+	at the storage path is always complete. */
+	struct _download{
+		string storage_path;
+		string part_path;
+		string hash;
+		string range;
+		FILE *fp					= nullptr;
+		CURL *eh					= nullptr;
+		curl_slist *list			= nullptr;
+		curl_off_t offset			= 0;
+		bool is_checked				= false;
+		headers_t headers;
+	};
+
+
+	size_t _write_to_part(
+		char *ptr,
+		size_t size,
+		size_t nmemb,
+		void *userdata
+	){
+		_download *d = (_download*)userdata;
+		if(!d->is_checked){
+			d->is_checked = true;
+			long code = 0;
+			curl_easy_getinfo(d->eh, CURLINFO_RESPONSE_CODE, &code);
+
+			/* Never write an error page into the part file */
+			if(code != OK && code != PARTIAL_CONTENT)
+				return 0;
+
+			/* The server ignored the range and is sending everything */
+			if(code == OK && d->offset > 0){
+				d->fp = freopen(d->part_path.c_str(), "wb", d->fp);
+				d->offset = 0;
+				if(d->fp == nullptr)
+					return 0;
+			}
+		}
+		return fwrite(ptr, size, nmemb, d->fp);
+	}
+
+
+	/* Total length of the resource from `Content-Range: bytes a-b/total` or
+	`bytes * /total`, or -1 if it isn't known. */
+	curl_off_t _get_range_total(const headers_t& headers){
+		auto it = headers.find("content-range");
+		if(it == headers.end())
+			return -1;
+		const string value = utils::to_lower(it->second);
+		size_t slash = value.rfind('/');
+		if(value.rfind("bytes ", 0) != 0 || slash == string::npos)
+			return -1;
+		/* Reject anything but digits, since stoll() would accept "12x" */
+		string total = value.substr(slash + 1);
+		if(total.empty() || !std::all_of(total.begin(), total.end(), ::isdigit))
+			return -1;
+		try{
+			return std::stoll(total);
+		}
+		catch(...){
+			return -1;
+		}
+	}
+
+
+	bool _begin_download(
+		CURL *eh,
+		_download& d,
+		const http::request& params
+	){
+		std::error_code ec;
+		d.eh = eh;
+		d.part_path = d.storage_path + ".part";
+		d.offset = std::filesystem::exists(d.part_path, ec) 
+			? (curl_off_t)std::filesystem::file_size(d.part_path, ec) 
+			: 0;
+		d.fp = fopen(d.part_path.c_str(), "ab");
+		if(d.fp == nullptr){
+			log::error("http::loop::download(): could not open {}", d.part_path);
+			return false;
+		}
+		if(d.offset > 0 && params.verbose > 0)
+			log::info("Resuming download of {} from {}.", d.storage_path, utils::convert_size(d.offset));
+
+		d.list = add_headers(eh, params.headers);
+		curl_easy_setopt(eh, CURLOPT_HEADER, 0);
+		curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, true);
+		/* Ask for the range directly instead of CURLOPT_RESUME_FROM_LARGE,
+		which fails outright if the server answers with the whole file. */
+		if(d.offset > 0){
+			d.range = std::format("{}-", d.offset);
+			curl_easy_setopt(eh, CURLOPT_RANGE, d.range.c_str());
+		}
+		curl_easy_setopt(eh, CURLOPT_WRITEDATA, (void*)&d);
+		curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, _write_to_part);
+		curl_easy_setopt(eh, CURLOPT_HEADERDATA, (void*)&d.headers);
+		curl_easy_setopt(eh, CURLOPT_HEADERFUNCTION, write_to_headers);
+		curl_easy_setopt(eh, CURLOPT_USERAGENT, constants::UserAgent.c_str());
+		curl_easy_setopt(eh, CURLOPT_TIMEOUT_MS, params.timeout);
+		if(params.verbose >= log::INFO){
+			curl_easy_setopt(eh, CURLOPT_VERBOSE, 1L);
+		}
+		return true;
+	}
+
+
+	/* Closes a download that is going to be tried again. Whatever made it
+	into the part file stays there, so the next attempt resumes from it. */
+	void _abort_download(_download& d){
+		curl_slist_free_all(d.list);
+		d.list = nullptr;
+		if(d.fp != nullptr){
+			fclose(d.fp);
+			d.fp = nullptr;
+		}
+	}
+
+
+	response _finish_download(
+		_download& d,
+		CURLcode result,
+		const http::request& params
+	){
+		namespace fs = std::filesystem;
+		std::error_code ec;
+		response r;
+		curl_easy_getinfo(d.eh, CURLINFO_RESPONSE_CODE, &r.code);
+		r.headers = d.headers;
+		curl_slist_free_all(d.list);
+		d.list = nullptr;
+		if(d.fp != nullptr){
+			fclose(d.fp);
+			d.fp = nullptr;
+		}
+
+		/* 416 means there was nothing left to send after the offset, which
+		still has to be verified below. */
+		bool is_range_done = r.code == RANGE_NOT_SATISFIABLE && d.offset > 0;
+		if(!is_range_done && (result != CURLE_OK || (r.code != OK && r.code != PARTIAL_CONTENT))){
+			log::error("http::loop::download(): could not download {} (HTTP {}): {}", 
+				d.storage_path, r.code, curl_easy_strerror(result));
+			if(fs::file_size(d.part_path, ec) == 0)
+				fs::remove(d.part_path, ec);
+			return r;
+		}
+
+		curl_off_t size = (curl_off_t)fs::file_size(d.part_path, ec);
+		curl_off_t expected = _get_range_total(d.headers);
+		if(expected < 0 && r.code == OK){
+			curl_easy_getinfo(d.eh, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &expected);
+		}
+		if(expected >= 0 && size != expected){
+			log::error("http::loop::download(): {} is incomplete ({} of {} bytes).", 
+				d.storage_path, size, expected);
+			if(size > expected)
+				fs::remove(d.part_path, ec);
+			r.code = 0;
+			return r;
+		}
+		if(!d.hash.empty()){
+			string digest = utils::sha256_file(d.part_path);
+			if(digest != utils::to_lower(d.hash)){
+				log::error("http::loop::download(): hash mismatch for {}.", d.storage_path);
+				fs::remove(d.part_path, ec);
+				r.code = 0;
+				return r;
+			}
+		}
+		else if(expected < 0 && is_range_done){
+			/* Nothing to check the part file against, so start over */
+			fs::remove(d.part_path, ec);
+			r.code = 0;
+			return r;
+		}
+
+		fs::rename(d.part_path, d.storage_path, ec);
+		if(ec){
+			log::error("http::loop::download(): could not rename {}: {}", d.part_path, ec.message());
+			r.code = 0;
+			return r;
+		}
+		r.code = OK;
+		return r;
+	}
+
+
+	size_t _write_to_segment(
+		char *ptr,
+		size_t size,
+		size_t nmemb,
+		void *userdata
+	){
+		_segment *s = (_segment*)userdata;
+		size_t realsize = size * nmemb;
+		long code = 0;
+		curl_easy_getinfo(s->eh, CURLINFO_RESPONSE_CODE, &code);
+		if(code != PARTIAL_CONTENT || s->begin + s->written + (curl_off_t)realsize > s->end + 1)
+			return 0;
+
+		ssize_t n = pwrite(s->fd, ptr, realsize, s->begin + s->written);
+		if(n != (ssize_t)realsize)
+			return 0;
+		s->written += realsize;
+		if(s->written - s->saved >= GDPM_HTTP_SEGMENT_SAVE_INTERVAL)
+			_save_segments(*s->parent);
+		return realsize;
+	}
+
+
+	bool _save_segments(_segments& s){
+		/* Written next to the state file and renamed over it, so a crash
+		leaves either the old or the new state behind. */
+		string tmp_path = s.path + ".tmp";
+		{
+			std::ofstream ofs(tmp_path, std::ios::trunc);
+			ofs << s.length << '\n' << s.validator << '\n';
+			for(const _segment& seg : s.list)
+				ofs << seg.begin << ' ' << seg.end << ' ' << seg.written << '\n';
+			if(!ofs)
+				return false;
+		}
+		std::error_code ec;
+		std::filesystem::rename(tmp_path, s.path, ec);
+		if(ec)
+			return false;
+		for(_segment& seg : s.list)
+			seg.saved = seg.written;
+		return true;
+	}
+
+
+	bool _load_segments(_segments& s){
+		std::ifstream ifs(s.path);
+		curl_off_t length = -1;
+		string validator;
+		if(!(ifs >> length) || !ifs.ignore() || !std::getline(ifs, validator))
+			return false;
+		if(length != s.length || validator != s.validator)
+			return false;
+
+		/* The segments have to cover the file from start to end */
+		std::vector<_segment> list;
+		_segment seg;
+		curl_off_t next = 0;
+		while(ifs >> seg.begin >> seg.end >> seg.written){
+			if(seg.begin != next || seg.end < seg.begin || seg.end >= length)
+				return false;
+			if(seg.written < 0 || seg.written > seg.end - seg.begin + 1)
+				return false;
+			seg.saved = seg.written;
+			seg.is_done = seg.written == seg.end - seg.begin + 1;
+			list.emplace_back(seg);
+			next = seg.end + 1;
+		}
+		if(list.empty() || next != length)
+			return false;
+		s.list = std::move(list);
+		return true;
+	}
 
-			if(cres == CURLM_OK){
-				/* wait for activity, timeout or "nothing" */
-				cres = curl_multi_poll(cm, NULL, 0, params.timeout, &numfds);
-			}
 
-			if(cres != CURLM_OK){
-				log::error(error(
-					ec::LIBCURL_ERR,
-				"http::multi::execute(): curl_multi_poll() returned an error"
-				));
-				break;
-			}
-			int messages_left = -1;
-			while((cmessage = curl_multi_info_read(cm, &messages_left))){
-				if(cmessage->msg == CURLMSG_DONE){
-					char *url;
-					CURL *eh = cmessage->easy_handle;
-					int code = 0;
-					curl_easy_getinfo(cmessage->easy_handle, CURLINFO_EFFECTIVE_URL, &url);
-					curl_easy_getinfo(cmessage->easy_handle, CURLINFO_RESPONSE_CODE, &code);
-					if((int)cmessage->data.result != CURLM_OK){
-						log::error(error(ec::LIBCURL_ERR,
-							std::format("http::context::execute({}): {} <url: {}>", 
-								(int)cmessage->data.result, curl_easy_strerror(cmessage->data.result), url))
-						);
-					}
-					log::println("transfers left: {}", transfers_left);
-					cres = curl_multi_remove_handle(cm, eh);
-					if(cres != CURLM_OK){
-						log::error(error(ec::LIBCURL_ERR, 
-							std::format("http::context::execute(): curl_multi_remove_handle() returned error {}", (int)cres)));
-					}
-					curl_easy_cleanup(eh);
-					transfers_left -= 1;
-				}
-				else{
-					log::error(error(ec::LIBCURL_ERR,
-						std::format("http::context::execute(): {}", (int)cmessage->msg))
-					);
-				}
-				if(transfers_index < urls.size()-1){
-					add_transfer(urls.at(transfers_index), params);
-				}
-			}
-			if(transfers_left){
-				cres = curl_multi_wait(cm, NULL, 0, params.timeout, NULL);
-				if(cres != CURLM_OK){
-					log::error(error(ec::LIBCURL_ERR,
-						std::format("http::context::execute(): curl_multi_wait() returned an error {}", (int)cres)));
-				}
-			}
-		}while(transfers_left);
-		cres = curl_multi_cleanup(cm);
-		if(cres != CURLM_OK){
-			log::error(error(ec::LIBCURL_ERR,
-				std::format("http::context::execute(): curl_multi_cleanup() returned an error {}", (int)cres)));
-		}
-		return responses();
+	void _remove_segments(const string& storage_path){
+		std::error_code ec;
+		std::filesystem::remove(storage_path + ".segments", ec);
+		std::filesystem::remove(storage_path + ".segments.state", ec);
 	}
 
 
 	response context::download_file(
 		const string& url, 
 		const string& storage_path, 
-		const http::request& params
+		const http::request& params,
+		const string& hash
 	){
-		// CURL *curl = nullptr;
-		CURLcode res;
-		response r;
-		FILE *fp;
+		/* Downloads are driven by an event loop, which is also where they
+		are split into byte ranges, resumed and retried. */
+		loop l(max_transfers);
+		try{
+			return l.run(l.download(url, storage_path, params, hash));
+		}
+		catch(const std::exception& e){
+			log::error("http::context::download_file(): {}", e.what());
+			return response();
+		}
+	}
 
-		if(curl){
-			fp = fopen(storage_path.c_str(), "wb");
-			utils::memory_buffer *data;
-			curl_slist *list = add_headers(curl, params.headers);
-			curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-			curl_easy_setopt(curl, CURLOPT_FAILONERROR, true);
-			curl_easy_setopt(curl, CURLOPT_HEADER, 0);
-			curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, true);
-			curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_to_stream);
-			curl_easy_setopt(curl, CURLOPT_NOPROGRESS, false);
-			curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &data);
-			curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, show_download_progress);
-			curl_easy_setopt(curl, CURLOPT_USERAGENT, constants::UserAgent.c_str());
-			curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, params.timeout);
-			res = curl_easy_perform(curl);
-			curl_slist_free_all(list);
 
-			/* Get response code, process error, save data, and close file. */
-			curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &r.code);
-			if(res != CURLE_OK && params.verbose > 0){
-				log::error("http::context::download_file::curl_easy_perform() failed: {}", curl_easy_strerror(res));
-			}
-			fclose(fp);
-		}
+	responses context::download_files(
+		const string_list &urls, 
+		const string_list &storage_paths,
+		const http::request& params,
+		const string_list& hashes
+	){
+		responses r(urls.size());
+		download_files(urls, storage_paths,
+			[&r](size_t i, response& response){
+				r[i] = std::move(response);
+			},
+			params, hashes
+		);
 		return r;
 	}
 
 
-	responses context::download_files(
+	task<> _download_to(
+		loop& l,
+		size_t index,
+		string url,
+		string storage_path,
+		http::request params,
+		string hash,
+		const response_callback& on_download
+	){
+		response r = co_await l.download(std::move(url), std::move(storage_path), std::move(params), std::move(hash));
+		on_download(index, r);
+	}
+
+
+	error context::download_files(
 		const string_list &urls, 
 		const string_list &storage_paths,
-		const http::request& params
+		const response_callback& on_download,
+		const http::request& params,
+		const string_list& hashes
 	){
-		if(cm == nullptr){
-			log::error(error(ec::PRECONDITION_FAILED, 
-				"http::multi::make_downloads(): multi client not initialized.")
-			);
-			return responses();
-		}
 		if(urls.size() != storage_paths.size()){
-			log::error(error(ec::ASSERTION_FAILED, 
-				"http::context::make_downloads(): urls.size() != storage_paths.size()"
+			return log::error_rc(error(ec::ASSERTION_FAILED, 
+				"http::context::download_files(): urls.size() != storage_paths.size()"
 			));
 		}
-		transfers_left = urls.size();
-		transfers_index = 0;
-		auto add_transfer = [this](const string& url, const string& storage_path, const http::request& params){
-			CURL *curl = curl_easy_init();
-			utils::memory_buffer *data;
-			if(curl){
-				FILE *fp = fopen(storage_path.c_str(), "wb");
-				curl_slist *list = add_headers(curl, params.headers);
-				curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-				curl_easy_setopt(curl, CURLOPT_FAILONERROR, true);
-				curl_easy_setopt(curl, CURLOPT_HEADER, 0);
-				curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, true);
-				curl_easy_setopt(curl, CURLOPT_PRIVATE, fp);
-				curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-				curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_to_stream);
-				curl_easy_setopt(curl, CURLOPT_NOPROGRESS, false);
-				curl_easy_setopt(curl, CURLOPT_XFERINFODATA, &data);
-				curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, show_download_progress);
-				curl_easy_setopt(curl, CURLOPT_USERAGENT, constants::UserAgent.c_str());
-				curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, params.timeout);
-				if(params.verbose >= log::INFO){
-					curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-				}
-				cres = curl_multi_add_handle(cm, curl);
-				curl_slist_free_all(list);
-				if(cres != CURLM_OK){
-					log::error("http::context::make_downstd::format(loads(): {}", curl_multi_strerror(cres));
-				}
-			}
-			transfers_index += 1;
-		};
+		loop l(max_transfers);
 		for(size_t i = 0; i < urls.size(); i++){
-			add_transfer(urls.at(i), storage_paths.at(i), params);
-		}
-		int still_running = 1;
-		int numfds = 0;
-		do{
-			cres = curl_multi_perform(cm, &still_running);
-
-			if(cres == CURLM_OK){
-				/* wait for activity, timeout or "nothing" */
-				cres = curl_multi_poll(cm, NULL, 0, 1000, &numfds);
-			}
-
-			if(cres != CURLM_OK){
-				log::error(error(
-					ec::LIBCURL_ERR,
-				"http::multi::execute(): curl_multi_poll() returned an error"
-				));
-				break;
-			}
-			int messages_left = -1;
-			while((cmessage = curl_multi_info_read(cm, &messages_left))){
-				if(cmessage->msg == CURLMSG_DONE){
-					char *url = nullptr;
-					FILE *fp = nullptr;
-					CURL *eh = cmessage->easy_handle;
-					int code = 0;
-					curl_easy_getinfo(cmessage->easy_handle, CURLINFO_EFFECTIVE_URL, &url);
-					curl_easy_getinfo(cmessage->easy_handle, CURLINFO_RESPONSE_CODE, &code);
-					curl_easy_getinfo(cmessage->easy_handle, CURLINFO_PRIVATE, &fp);
-					if((int)cmessage->data.result != CURLM_OK){
-						log::error(error(ec::LIBCURL_ERR,
-							std::format("http::context::execute({}): {} <url: {}>", (int)cmessage->data.result, curl_easy_strerror(cmessage->data.result), url))
-						);
-					}
-					cres = curl_multi_remove_handle(cm, eh);
-					if(cres != CURLM_OK){
-						log::error("http::context::execute(): curl_multi_remove_handle() returned error {}", (int)cres);
-					}
-					transfers_left -= 1;
-					curl_easy_cleanup(eh);
-					if(fp)
-						fclose(fp);
-				}
-				else{
-					log::error(error(ec::LIBCURL_ERR,
-						std::format("http::context::execute(): {}", (int)cmessage->msg))
-					);
-				}
-				if(transfers_index < urls.size()-1){
-					add_transfer(urls.at(transfers_index), storage_paths.at(transfers_index), params);
-				}
-			}
-			if(transfers_left){
-				cres = curl_multi_wait(cm, NULL, 0, params.timeout, NULL);
-				if(cres != CURLM_OK){
-					log::error("http::context::execute(): curl_multi_wait() returned an error {}", (int)cres);
-				}
-			}
-		}while(transfers_left);
-		cres = curl_multi_cleanup(cm);
-		if(cres != CURLM_OK){
-			log::error("http::context::execute(): curl_multi_cleanup() returned an error {}", (int)cres);
+			string hash = (i < hashes.size()) ? hashes[i] : "";
+			l.spawn(_download_to(l, i, urls[i], storage_paths[i], params, hash, on_download));
 		}
-		return responses();
+		return l.run();
 	}
 
 
@@ -394,7 +1266,725 @@ namespace gdpm::http{
 
 
 	void context::set_max_transfers(int max_transfers){
+		/* Only limits HTTP/1.1 connections since HTTP/2 transfers to the same
+		host are multiplexed over one. */
+		this->max_transfers = max_transfers;
 		curl_multi_setopt(cm, CURLMOPT_MAX_TOTAL_CONNECTIONS, max_transfers);
+		window.set_max_transfers(max_transfers);
+	}
+
+
+	void context::release_buffer(string&& body){
+		/* Oversized buffers are dropped so one huge page doesn't stay pinned */
+		if(body.capacity() == 0 || body.capacity() > GDPM_HTTP_BUFFER_MAX_SIZE)
+			return;
+		if(buffers.size() >= GDPM_HTTP_BUFFER_POOL_SIZE)
+			return;
+		body.clear();
+		buffers.emplace_back(std::move(body));
+	}
+
+
+	string context::_acquire_buffer(){
+		if(buffers.empty())
+			return string();
+		string body = std::move(buffers.back());
+		buffers.pop_back();
+		return body;
+	}
+
+
+	transfer_window::transfer_window(int max_transfers){
+		round_start = std::chrono::steady_clock::now();
+		set_max_transfers(max_transfers);
+	}
+
+
+	void transfer_window::set_max_transfers(int max_transfers){
+		/* Grow quickly up to the limit until the server pushes back */
+		this->max_transfers = std::max(max_transfers, 1);
+		threshold = this->max_transfers;
+		window = std::min(window, threshold);
+	}
+
+
+	size_t transfer_window::get_limit() const{
+		return std::clamp<size_t>((size_t)window, 1, max_transfers);
+	}
+
+
+	void transfer_window::update(bool is_congested, curl_off_t bytes, std::chrono::steady_clock::time_point now){
+		using namespace std::chrono;
+		if(is_congested){
+			/* Everything in flight when the server pushed back will likely
+			report it too, so only back off once per round. */
+			if(!round_congested){
+				threshold = std::max(window / 2.0, 1.0);
+				window = threshold;
+				round_congested = true;
+				log::debug("http::transfer_window: congestion, window is now {}", get_limit());
+			}
+		}
+		else{
+			/* Add one per finished transfer below the threshold, which
+			doubles the window every round, and one per round above it. */
+			round_bytes += std::max<curl_off_t>(bytes, 0);
+			window += (window < threshold) ? 1.0 : 1.0 / window;
+			window = std::min(window, (double)max_transfers);
+		}
+
+		round_finished += 1;
+		if(round_finished < get_limit())
+			return;
+
+		/* A wider window that moves less data means the link or the server
+		is saturated, so settle one below it. */
+		double seconds = duration<double>(now - round_start).count();
+		double throughput = (seconds > 0.0) ? round_bytes / seconds : 0.0;
+		if(!round_congested && last_throughput > 0.0 && throughput < last_throughput * 0.9 && window > 1.0){
+			threshold = std::max(window - 1.0, 1.0);
+			window = threshold;
+			log::debug("http::transfer_window: throughput dropped, window is now {}", get_limit());
+		}
+		last_throughput = throughput;
+		round_finished = 0;
+		round_bytes = 0;
+		round_congested = false;
+		round_start = now;
+	}
+
+
+	void context::_record_latency(std::chrono::steady_clock::duration latency){
+		double ms = std::chrono::duration<double, std::milli>(latency).count();
+		if(latencies.size() < GDPM_HTTP_LATENCY_SAMPLES)
+			latencies.emplace_back(ms);
+		else
+			latencies[latencies_next] = ms;
+		latencies_next = (latencies_next + 1) % GDPM_HTTP_LATENCY_SAMPLES;
+	}
+
+
+	std::chrono::milliseconds context::_get_hedge_delay(double percentile) const{
+		/* Too few samples would make every request look slow */
+		if(latencies.size() < GDPM_HTTP_HEDGE_MIN_SAMPLES)
+			return std::chrono::milliseconds(-1);
+		std::vector<double> sorted(latencies);
+		size_t n = (size_t)(std::clamp(percentile, 0.0, 1.0) * (sorted.size() - 1));
+		std::nth_element(sorted.begin(), sorted.begin() + n, sorted.end());
+		return std::chrono::milliseconds((long)std::ceil(sorted[n]));
+	}
+
+
+	loop::loop(int max_transfers): max_transfers(std::max(max_transfers, 1)){
+		_initialize_share();
+		window.set_max_transfers(this->max_transfers);
+		cm = curl_multi_init();
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+		/* Nothing can run without these, so `run()` reports this instead */
+		if(cm == nullptr){
+			status = log::error_rc(ec::LIBCURL_ERR, "http::loop::loop(): curl_multi_init() failed.");
+			return;
+		}
+		epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.fd = wake_fd;
+		if(epoll_fd < 0 || wake_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) != 0){
+			status = log::error_rc(ec::STD_ERR,
+				std::format("http::loop::loop(): could not create event loop: {}", strerror(errno))
+			);
+			return;
+		}
+		curl_multi_setopt(cm, CURLMOPT_SOCKETFUNCTION, _on_socket);
+		curl_multi_setopt(cm, CURLMOPT_SOCKETDATA, this);
+		curl_multi_setopt(cm, CURLMOPT_TIMERFUNCTION, _on_timer);
+		curl_multi_setopt(cm, CURLMOPT_TIMERDATA, this);
+		curl_multi_setopt(cm, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+		curl_multi_setopt(cm, CURLMOPT_MAX_CONCURRENT_STREAMS, _settings.max_host_streams);
+		/* Every download can have up to `max_segments` ranges open, each
+		on a connection of its own. */
+		curl_multi_setopt(cm, CURLMOPT_MAX_TOTAL_CONNECTIONS, 
+			(long)this->max_transfers * std::max(_settings.max_segments, 1)
+		);
+	}
+
+
+	loop::~loop(){
+		/* Offloaded work still points at the loop */
+		while(offloads > 0)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		/* Tasks that never finished are destroyed with their transfers
+		still on the multi handle, so take them off first. */
+		for(CURL *eh : handles)
+			curl_multi_remove_handle(cm, eh);
+		spawned.clear();
+		abandoned.clear();
+		curl_multi_cleanup(cm);
+		if(wake_fd >= 0)
+			close(wake_fd);
+		if(epoll_fd >= 0)
+			close(epoll_fd);
+	}
+
+
+	string loop::url_escape(const string& url){
+		CURL *curl = acquire_handle();
+		char *escaped = curl_easy_escape(curl, url.c_str(), url.size());
+		string s = (escaped != nullptr) ? escaped : "";
+		curl_free(escaped);
+		release_handle(curl);
+		return s;
+	}
+
+
+	int loop::_on_socket(CURL *eh, curl_socket_t s, int what, void *userp, void *socketp){
+		loop *l = (loop*)userp;
+		if(what == CURL_POLL_REMOVE){
+			epoll_ctl(l->epoll_fd, EPOLL_CTL_DEL, s, nullptr);
+			return 0;
+		}
+		epoll_event ev{};
+		ev.data.fd = s;
+		ev.events = ((what & CURL_POLL_IN) ? EPOLLIN : 0) | ((what & CURL_POLL_OUT) ? EPOLLOUT : 0);
+		if(epoll_ctl(l->epoll_fd, EPOLL_CTL_MOD, s, &ev) != 0 && errno == ENOENT)
+			epoll_ctl(l->epoll_fd, EPOLL_CTL_ADD, s, &ev);
+		return 0;
+	}
+
+
+	int loop::_on_timer(CURLM *cm, long timeout_ms, void *userp){
+		loop *l = (loop*)userp;
+		if(timeout_ms < 0)
+			l->curl_deadline.reset();
+		else
+			l->curl_deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+		return 0;
+	}
+
+
+	void loop::transfer_awaiter::await_suspend(std::coroutine_handle<> h){
+		handle = h;
+		l->_start(this);
+	}
+
+
+	void loop::sleep_awaiter::await_suspend(std::coroutine_handle<> h){
+		l->timers.emplace(std::chrono::steady_clock::now() + delay, h);
+	}
+
+
+	bool loop::slot_awaiter::await_ready() noexcept{
+		if(l->slots >= (size_t)l->max_transfers)
+			return false;
+		l->slots += 1;
+		return true;
+	}
+
+
+	void loop::slot_awaiter::await_suspend(std::coroutine_handle<> h){
+		l->slot_waiting.emplace_back(h);
+	}
+
+
+	void loop::_release_slot(){
+		/* Hand the slot straight to the next download in line */
+		if(slot_waiting.empty()){
+			slots -= 1;
+			return;
+		}
+		ready.emplace_back(slot_waiting.front());
+		slot_waiting.pop_front();
+	}
+
+
+	void loop::_start(transfer_awaiter *t){
+		if(!t->is_reserved && active >= window.get_limit()){
+			waiting.emplace_back(t);
+			return;
+		}
+		curl_easy_setopt(t->eh, CURLOPT_PRIVATE, (void*)t);
+		CURLMcode res = curl_multi_add_handle(cm, t->eh);
+		if(res != CURLM_OK){
+			log::error("http::loop::_start(): curl_multi_add_handle(): {}", curl_multi_strerror(res));
+			t->result = CURLE_FAILED_INIT;
+			ready.emplace_back(t->handle);
+			return;
+		}
+		handles.emplace(t->eh);
+		active += 1;
+	}
+
+
+	void loop::_read_messages(){
+		CURLMsg *message = nullptr;
+		int messages_left = 0;
+		while((message = curl_multi_info_read(cm, &messages_left))){
+			if(message->msg != CURLMSG_DONE)
+				continue;
+			transfer_awaiter *t = nullptr;
+			CURL *eh = message->easy_handle;
+			CURLcode result = message->data.result;
+			long code = 0;
+			curl_off_t bytes = 0;
+			curl_easy_getinfo(eh, CURLINFO_PRIVATE, (char**)&t);
+			curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &code);
+			curl_easy_getinfo(eh, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+			window.update(_is_congested(code, result), bytes);
+			curl_multi_remove_handle(cm, eh);
+			handles.erase(eh);
+			active -= 1;
+			t->result = result;
+			ready.emplace_back(t->handle);
+		}
+		while(active < window.get_limit() && !waiting.empty()){
+			transfer_awaiter *t = waiting.front();
+			waiting.pop_front();
+			_start(t);
+		}
+	}
+
+
+	void loop::post(std::coroutine_handle<> h){
+		{
+			std::lock_guard lock(posted_mutex);
+			posted.emplace_back(h);
+		}
+		std::uint64_t one = 1;
+		ssize_t n = write(wake_fd, &one, sizeof(one));
+		(void)n;
+	}
+
+
+	void loop::spawn(task<> t){
+		ready.emplace_back(t.get_handle());
+		spawned.emplace_back(std::move(t));
+	}
+
+
+	error loop::run(){
+		error error = _run_until([this](){
+			return std::all_of(spawned.begin(), spawned.end(), [](const task<>& t){ return t.is_done(); });
+		});
+		for(task<>& t : spawned){
+			if(!t.is_done()){
+				/* The loop may still hold on to the task's frame */
+				abandoned.emplace_back(std::make_shared<task<>>(std::move(t)));
+				continue;
+			}
+			try{
+				t.get_result();
+			}
+			catch(const std::exception& e){
+				log::error("http::loop::run(): task failed: {}", e.what());
+			}
+		}
+		spawned.clear();
+		return error;
+	}
+
+
+	error loop::_run_until(const std::function<bool()>& is_done){
+		using namespace std::chrono;
+		if(status.has_occurred())
+			return status;
+		constexpr int max_events = 64;
+		epoll_event events[max_events];
+		int still_running = 0;
+		while(true){
+			while(!ready.empty()){
+				std::coroutine_handle<> h = ready.front();
+				ready.pop_front();
+				h.resume();
+			}
+			if(is_done())
+				return error();
+
+			auto now = steady_clock::now();
+			while(!timers.empty() && timers.top().first <= now){
+				ready.emplace_back(timers.top().second);
+				timers.pop();
+			}
+			if(curl_deadline && *curl_deadline <= now){
+				curl_deadline.reset();
+				curl_multi_socket_action(cm, CURL_SOCKET_TIMEOUT, 0, &still_running);
+				_read_messages();
+			}
+			if(!ready.empty())
+				continue;
+
+			/* An offload posts its resumption before it stops counting, so
+			reading both under the lock never sees neither. */
+			bool has_pending = false;
+			{
+				std::lock_guard lock(posted_mutex);
+				has_pending = !posted.empty() || offloads > 0;
+			}
+			if(active == 0 && waiting.empty() && timers.empty() && !has_pending){
+				return log::error_rc(ec::ASSERTION_FAILED,
+					"http::loop::_run_until(): tasks are waiting on nothing."
+				);
+			}
+
+			/* Sleep until a socket is ready, work is posted from another
+			thread or the next timer is due. */
+			int timeout = -1;
+			auto next = (curl_deadline) ? std::optional(*curl_deadline) : std::nullopt;
+			if(!timers.empty())
+				next = (next) ? std::min(*next, timers.top().first) : timers.top().first;
+			if(next)
+				timeout = (int)std::max<long>(duration_cast<milliseconds>(*next - now).count() + 1, 0);
+			int n = epoll_wait(epoll_fd, events, max_events, timeout);
+			if(n < 0 && errno != EINTR){
+				return log::error_rc(ec::STD_ERR,
+					std::format("http::loop::_run_until(): epoll_wait(): {}", strerror(errno))
+				);
+			}
+			for(int i = 0; i < n; i++){
+				if(events[i].data.fd == wake_fd){
+					std::uint64_t count = 0;
+					ssize_t r = read(wake_fd, &count, sizeof(count));
+					(void)r;
+					continue;
+				}
+				int flags = 0;
+				if(events[i].events & EPOLLIN)
+					flags |= CURL_CSELECT_IN;
+				if(events[i].events & EPOLLOUT)
+					flags |= CURL_CSELECT_OUT;
+				if(events[i].events & (EPOLLERR | EPOLLHUP))
+					flags |= CURL_CSELECT_ERR;
+				curl_multi_socket_action(cm, events[i].data.fd, flags, &still_running);
+			}
+			_read_messages();
+			{
+				std::lock_guard lock(posted_mutex);
+				ready.insert(ready.end(), posted.begin(), posted.end());
+				posted.clear();
+			}
+		}
+	}
+
+
+	task<response> loop::get(string url, http::request params){
+		response r;
+		_cache_entry entry;
+		const string host = _get_host(url);
+		const bool use_cache = params.use_cache && params.method == method::GET;
+		const bool is_cached = use_cache && _cache_load(url, entry);
+		for(int attempt = 1;; attempt++){
+			for(auto wait = _acquire_host(host); wait.count() > 0; wait = _acquire_host(host))
+				co_await sleep_for(wait);
+
+			CURL *eh = acquire_handle();
+			if(eh == nullptr)
+				co_return r;
+			r = response();
+			_body_sink sink{ .body = &r.body, .eh = eh };
+			curl_slist *list = add_headers(eh, 
+				(is_cached) ? _cache_headers(params.headers, entry) : params.headers
+			);
+			curl_easy_setopt(eh, CURLOPT_URL, url.c_str());
+			_set_encoding(eh, params);
+			curl_easy_setopt(eh, CURLOPT_WRITEDATA, (void*)&sink);
+			curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, _write_to_body);
+			curl_easy_setopt(eh, CURLOPT_HEADERDATA, (void*)&r.headers);
+			curl_easy_setopt(eh, CURLOPT_HEADERFUNCTION, write_to_headers);
+			curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, true);
+			curl_easy_setopt(eh, CURLOPT_USERAGENT, constants::UserAgent.c_str());
+			curl_easy_setopt(eh, CURLOPT_TIMEOUT_MS, params.timeout);
+			CURLcode result = co_await _perform(eh);
+			curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &r.code);
+			if(result != CURLE_OK)
+				r.body.clear();
+			_get_sizes(eh, r);
+			curl_slist_free_all(list);
+			release_handle(eh);
+
+			if(_is_throttled(r.code) && attempt <= GDPM_HTTP_MAX_THROTTLED_RETRIES){
+				_throttle_host(host, r.headers, attempt);
+				continue;
+			}
+			if(_can_retry(params, r.code, result) && attempt < params.retry.max_attempts){
+				auto delay = params.retry.get_delay(attempt);
+				log::debug("http::loop::get(): retrying <url: {}> in {}ms", url, delay.count());
+				co_await sleep_for(delay);
+				continue;
+			}
+			if(result != CURLE_OK){
+				log::error("http::loop::get(): {} <url: {}>", curl_easy_strerror(result), url);
+				co_return r;
+			}
+			break;
+		}
+		if(use_cache)
+			_cache_update(url, r, (is_cached) ? &entry : nullptr);
+		co_return r;
+	}
+
+
+	task<response> loop::download(
+		string url, 
+		string storage_path, 
+		http::request params, 
+		string hash
+	){
+		response r;
+		std::error_code ec;
+		const string host = _get_host(url);
+
+		/* A download that was already started resumes from its part file
+		instead, since that is usually all that is left. */
+		if(_settings.max_segments > 1 && !std::filesystem::exists(storage_path + ".part", ec)){
+			std::optional<response> segmented = co_await _download_segments(url, storage_path, params, hash);
+			if(segmented)
+				co_return *segmented;
+		}
+		for(int attempt = 1;; attempt++){
+			for(auto wait = _acquire_host(host); wait.count() > 0; wait = _acquire_host(host))
+				co_await sleep_for(wait);
+
+			CURL *eh = acquire_handle();
+			if(eh == nullptr)
+				co_return response();
+			_download d{ .storage_path = storage_path, .hash = hash };
+			curl_easy_setopt(eh, CURLOPT_URL, url.c_str());
+			if(!_begin_download(eh, d, params)){
+				release_handle(eh);
+				co_return response();
+			}
+			CURLcode result = co_await _perform(eh);
+
+			long code = 0;
+			curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &code);
+			if(_is_throttled(code) && attempt <= GDPM_HTTP_MAX_THROTTLED_RETRIES){
+				_abort_download(d);
+				release_handle(eh);
+				_throttle_host(host, d.headers, attempt);
+				continue;
+			}
+			if(_can_retry(params, code, result) && attempt < params.retry.max_attempts){
+				_abort_download(d);
+				release_handle(eh);
+				auto delay = params.retry.get_delay(attempt);
+				log::warn("Download of {} failed ({}). Retrying in {}ms.", storage_path, 
+					(result != CURLE_OK) ? curl_easy_strerror(result) : std::format("HTTP {}", code), delay.count());
+				co_await sleep_for(delay);
+				continue;
+			}
+
+			/* Checking the length and hash reads the whole file, so keep the
+			loop moving while that happens. */
+			r = co_await offload([&d, result, &params](){ return _finish_download(d, result, params); });
+			release_handle(eh);
+
+			/* Segments left behind by an earlier run are of no use now */
+			if(r.code == OK)
+				_remove_segments(storage_path);
+			co_return r;
+		}
+	}
+
+
+	task<> loop::_download_range(_segment& s, string url, http::request params){
+		const string host = _get_host(url);
+		for(int attempt = 1;; attempt++){
+			for(auto wait = _acquire_host(host); wait.count() > 0; wait = _acquire_host(host))
+				co_await sleep_for(wait);
+
+			CURL *eh = acquire_handle();
+			if(eh == nullptr)
+				co_return;
+			headers_t headers;
+			s.eh = eh;
+			s.range = std::format("{}-{}", s.begin + s.written, s.end);
+			curl_slist *list = add_headers(eh, params.headers);
+			/* Ranges only download faster on connections of their own, so
+			don't multiplex them over the HTTP/2 connection to the host. */
+			curl_easy_setopt(eh, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1);
+			curl_easy_setopt(eh, CURLOPT_PIPEWAIT, 0L);
+			curl_easy_setopt(eh, CURLOPT_URL, url.c_str());
+			curl_easy_setopt(eh, CURLOPT_RANGE, s.range.c_str());
+			curl_easy_setopt(eh, CURLOPT_WRITEDATA, (void*)&s);
+			curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, _write_to_segment);
+			curl_easy_setopt(eh, CURLOPT_HEADERDATA, (void*)&headers);
+			curl_easy_setopt(eh, CURLOPT_HEADERFUNCTION, write_to_headers);
+			curl_easy_setopt(eh, CURLOPT_USERAGENT, constants::UserAgent.c_str());
+			curl_easy_setopt(eh, CURLOPT_TIMEOUT_MS, params.timeout);
+			CURLcode result = co_await _perform(eh, true);
+			long code = 0;
+			curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &code);
+			curl_slist_free_all(list);
+			s.eh = nullptr;
+			release_handle(eh);
+
+			s.is_done = s.written == s.end - s.begin + 1;
+			_save_segments(*s.parent);
+			if(s.is_done)
+				co_return;
+
+			/* Only this range is tried again, from where it stopped */
+			if(_is_throttled(code) && attempt <= GDPM_HTTP_MAX_THROTTLED_RETRIES){
+				_throttle_host(host, headers, attempt);
+				continue;
+			}
+			if(_can_retry(params, code, result) && attempt < params.retry.max_attempts){
+				auto delay = params.retry.get_delay(attempt);
+				log::debug("http::loop::download(): retrying range {} <url: {}> in {}ms", s.range, url, delay.count());
+				co_await sleep_for(delay);
+				continue;
+			}
+			log::error("http::loop::download(): could not download range {} (HTTP {}): {} <url: {}>", 
+				s.range, code, curl_easy_strerror(result), url);
+			co_return;
+		}
+	}
+
+
+	task<std::optional<response>> loop::_download_segments(
+		string url,
+		string storage_path,
+		http::request params,
+		string hash
+	){
+		namespace fs = std::filesystem;
+		std::error_code ec;
+		response r;
+		const string host = _get_host(url);
+		const string seg_path = storage_path + ".segments";
+
+		/* Ask for the size first. Only split the download when the server
+		says it supports byte ranges and the file is big enough. */
+		for(auto wait = _acquire_host(host); wait.count() > 0; wait = _acquire_host(host))
+			co_await sleep_for(wait);
+		CURL *eh = acquire_handle();
+		if(eh == nullptr)
+			co_return std::nullopt;
+		headers_t headers;
+		curl_slist *list = add_headers(eh, params.headers);
+		curl_easy_setopt(eh, CURLOPT_URL, url.c_str());
+		curl_easy_setopt(eh, CURLOPT_NOBODY, 1L);
+		curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, true);
+		curl_easy_setopt(eh, CURLOPT_HEADERDATA, (void*)&headers);
+		curl_easy_setopt(eh, CURLOPT_HEADERFUNCTION, write_to_headers);
+		curl_easy_setopt(eh, CURLOPT_USERAGENT, constants::UserAgent.c_str());
+		curl_easy_setopt(eh, CURLOPT_TIMEOUT_MS, params.timeout);
+		CURLcode result = co_await _perform(eh);
+		curl_slist_free_all(list);
+		long code = 0;
+		curl_off_t length = -1;
+		char *effective_url = nullptr;
+		curl_easy_getinfo(eh, CURLINFO_RESPONSE_CODE, &code);
+		curl_easy_getinfo(eh, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+		curl_easy_getinfo(eh, CURLINFO_EFFECTIVE_URL, &effective_url);
+		string target_url = (effective_url != nullptr) ? effective_url : url;
+		release_handle(eh);
+		if(result != CURLE_OK || code != OK)
+			co_return std::nullopt;
+
+		auto accept_ranges = headers.find("accept-ranges");
+		bool has_ranges = accept_ranges != headers.end() && utils::to_lower(accept_ranges->second) == "bytes";
+		size_t min_size = std::max<size_t>(_settings.min_segment_size, 1);
+		curl_off_t count = std::min<curl_off_t>(_settings.max_segments, length / min_size);
+		if(!has_ranges || count < 2){
+			_remove_segments(storage_path);
+			co_return std::nullopt;
+		}
+
+		/* Pick up the segments of an earlier run if they are for the same
+		file. Without a validator or hash there is no telling. */
+		_segments state;
+		state.path = seg_path + ".state";
+		state.length = length;
+		if(headers.contains("etag"))
+			state.validator = headers["etag"];
+		else if(headers.contains("last-modified"))
+			state.validator = headers["last-modified"];
+		bool is_resumed = false;
+		if(!state.validator.empty() || !hash.empty()){
+			uintmax_t size = fs::file_size(seg_path, ec);
+			is_resumed = !ec && size == (uintmax_t)length && _load_segments(state);
+		}
+		if(!is_resumed){
+			_remove_segments(storage_path);
+			curl_off_t step = length / count;
+			state.list.resize(count);
+			for(curl_off_t i = 0; i < count; i++){
+				state.list[i].begin = i * step;
+				state.list[i].end = (i == count - 1) ? length - 1 : (i + 1) * step - 1;
+			}
+		}
+
+		int fd = open(seg_path.c_str(), O_WRONLY | O_CREAT, 0644);
+		if(fd < 0)
+			co_return std::nullopt;
+		if(!is_resumed && ftruncate(fd, length) != 0){
+			close(fd);
+			_remove_segments(storage_path);
+			co_return std::nullopt;
+		}
+		curl_off_t written = 0;
+		for(_segment& s : state.list){
+			s.fd = fd;
+			s.parent = &state;
+			written += s.written;
+		}
+		_save_segments(state);
+		if(params.verbose > 0){
+			if(is_resumed)
+				log::info("Resuming download of {} from {}.", storage_path, utils::convert_size(written));
+			else
+				log::info("Downloading {} in {} segments.", storage_path, count);
+		}
+
+		/* Segments write into their own regions of the file, so they can all
+		be in flight at once. The download holds one of the loop's slots
+		meanwhile, which is what bounds the connections it opens. */
+		co_await _acquire_slot();
+		std::vector<task<>> ranges;
+		for(_segment& s : state.list){
+			if(!s.is_done)
+				ranges.emplace_back(_download_range(s, target_url, params));
+		}
+		try{
+			co_await when_all(std::move(ranges));
+		}
+		catch(...){
+			_release_slot();
+			close(fd);
+			throw;
+		}
+		_release_slot();
+		close(fd);
+
+		bool is_complete = std::all_of(state.list.begin(), state.list.end(), 
+			[](const _segment& s){ return s.is_done; }
+		);
+		if(!is_complete){
+			/* Whatever the segments got is kept for the next run */
+			log::error("http::loop::download(): {} is incomplete. Run the command again to resume.", storage_path);
+			co_return r;
+		}
+		if(!hash.empty()){
+			auto check_hash = [seg_path, hash](){
+				return utils::sha256_file(seg_path) == utils::to_lower(hash);
+			};
+			if(!co_await offload(std::move(check_hash))){
+				log::error("http::loop::download(): hash mismatch for {}.", storage_path);
+				_remove_segments(storage_path);
+				co_return r;
+			}
+		}
+		fs::rename(seg_path, storage_path, ec);
+		if(ec){
+			log::error("http::loop::download(): could not rename {}: {}", seg_path, ec.message());
+			co_return r;
+		}
+		fs::remove(state.path, ec);
+		r.code = OK;
+		r.headers = std::move(headers);
+		co_return r;
 	}
 
 
@@ -469,11 +2059,17 @@ namespace gdpm::http{
 		size_t realsize = size * nmemb;
 		utils::memory_buffer *m = (utils::memory_buffer*)userdata;
 
-		m->addr = (char*)realloc(m->addr, m->size + realsize + 1);
-		if(m->addr == nullptr){
-			/* Out of memory */
-			log::error("Could not allocate memory (realloc returned NULL).");
-			return 0;
+		/* Grow geometrically instead of by each chunk */
+		if(m->size + realsize + 1 > m->capacity){
+			size_t capacity = std::max({m->size + realsize + 1, m->capacity * 2, (size_t)CURL_MAX_WRITE_SIZE});
+			char *addr = (char*)realloc(m->addr, capacity);
+			if(addr == nullptr){
+				/* Out of memory */
+				log::error("Could not allocate memory (realloc returned NULL).");
+				return 0;
+			}
+			m->addr = addr;
+			m->capacity = capacity;
 		}
 
 		memcpy(&(m->addr[m->size]), contents, realsize);
@@ -484,6 +2080,32 @@ namespace gdpm::http{
 	}
 
 
+	size_t write_to_headers(
+		char *buffer,
+		size_t size,
+		size_t nitems,
+		void *userdata
+	){
+		size_t realsize = size * nitems;
+		headers_t *headers = (headers_t*)userdata;
+		string line(buffer, realsize);
+
+		/* A new status line starts the headers of a redirected response */
+		if(line.starts_with("HTTP/")){
+			headers->clear();
+			return realsize;
+		}
+		size_t colon = line.find(':');
+		if(colon != string::npos){
+			headers->insert_or_assign(
+				utils::to_lower(utils::trim(line.substr(0, colon))),
+				utils::trim(line.substr(colon + 1))
+			);
+		}
+		return realsize;
+	}
+
+
 	size_t write_to_stream(
 		char *ptr, 
 		size_t size, 
@@ -534,7 +2156,6 @@ namespace gdpm::http{
 		// 	}
 		// }
 		show_console_cursor(true);
-		utils::memory_buffer *m = (utils::memory_buffer*)ptr;
 		return 0;
 	}
 }
\ No newline at end of file
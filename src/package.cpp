@@ -10,9 +10,12 @@
 #include "remote.hpp"
 #include "types.hpp"
 #include "utils.hpp"
+#include "task.hpp"
+#include <chrono>
 #include <filesystem>
 #include <functional>
 #include <future>
+#include <set>
 #include <rapidjson/error/en.h>
 #include <rapidjson/ostreamwrapper.h>
 #include <rapidjson/prettywriter.h>
@@ -20,6 +23,72 @@
 
 namespace gdpm::package{
 	
+	/* Looks up the details of `p` if the cache doesn't have them, then
+	downloads and extracts it into `package_dir`. `config`, `p` and `result`
+	have to outlive the loop. */
+	task<> _install_package(
+		http::loop& loop,
+		const config::context& config,
+		info& p,
+		string package_dir,
+		string tmp_zip,
+		package::params params,
+		error& result
+	){
+		using namespace rapidjson;
+
+		json::document doc;
+		result = co_await fetch_asset_details(loop, config, p, doc, params);
+		if(result.has_occurred()){
+			log::error(result);
+			co_return;
+		}
+
+		/* Dump asset information for lookup into JSON in package directory */
+		std::error_code ec;
+		std::filesystem::create_directories(package_dir, ec);
+		{
+			std::ofstream ofs(package_dir + "/asset.json");
+			OStreamWrapper osw(ofs);
+			PrettyWriter<OStreamWrapper> writer(osw);
+			doc.Accept(writer);
+		}
+
+		/* Downloads only show up at `tmp_zip` once they are complete, but
+		check the hash anyway in case the asset changed since. */
+		bool is_cached = std::filesystem::is_regular_file(tmp_zip, ec);
+		if(is_cached && !p.download_hash.empty()){
+			auto check_hash = [tmp_zip, hash = p.download_hash](){
+				return utils::sha256_file(tmp_zip) == utils::to_lower(hash);
+			};
+			if(!co_await loop.offload(std::move(check_hash))){
+				log::info("Cached package for \"{}\" is out of date.", p.title);
+				std::filesystem::remove(tmp_zip, ec);
+				is_cached = false;
+			}
+		}
+		if(is_cached){
+			log::info("Found cached package for \"{}\".", p.title);
+		}
+		else{
+			http::response r = co_await loop.download(p.download_url, tmp_zip, http::request(), p.download_hash);
+			if(r.code != http::OK){
+				result = log::error_rc(ec::HTTP_RESPONSE_ERR,
+					std::format("could not download {}. Run the command again to resume.", tmp_zip)
+				);
+				co_return;
+			}
+		}
+
+		/* Extract on another thread so the loop can keep the other packages
+		downloading in the meantime. */
+		auto extract = [tmp_zip, target = package_dir + "/"](){
+			return utils::extract_zip(tmp_zip.c_str(), target.c_str());
+		};
+		result = co_await loop.offload(std::move(extract));
+	}
+
+
 	error install(
 		const config::context& config,
 		package::title_list& package_titles, 
@@ -42,15 +111,18 @@ namespace gdpm::package{
 
 		/* Synchronize database information and then try to get data again from
 		cache if possible. */
-		if(config.enable_sync){
-			result_t result = fetch(config, package_titles);
+		/* Append files from --file option */
+		read_file_inputs(package_titles, params.input_files);
+		if(config.enable_sync && !is_sync_fresh(config, params)){
+			/* Only sync the requested packages instead of the whole catalog */
+			package::params sync_params = params;
+			sync_params.sync_method = SYNC_TARGETED;
+			result_t result = fetch(config, package_titles, sync_params);
 			error error = result.get_error();
 			if(error.has_occurred()){
 				return log::error_rc(ec::UNKNOWN, "package::install(): could not synchronize database.");
 			}
 		}
-		/* Append files from --file option */
-		read_file_inputs(package_titles, params.input_files);
 		result_t result = cache::get_package_info_by_title(package_titles);
 		package::info_list p_cache = result.unwrap_unsafe();
 
@@ -102,113 +174,38 @@ namespace gdpm::package{
 			);
 		}
 
-		// task_list tasks;
-		/* Retrieve necessary asset data if it was found already in cache */
-		std::vector<string_pair> target_extract_dirs;
-		rest_api::request_params rest_api_params = rest_api::make_from_config(config);
-		package::title_list p_download_urls;
-		package::path_list p_storage_paths;
-		for(auto& p : p_cache){
-			log::info_n("Fetching asset data for \"{}\"...", p.title);
-			string url{config.remote_sources.at(params.remote_source) + rest_api::endpoints::GET_AssetId};
-			string package_dir = config.packages_dir + "/" + p.title;
-			string tmp_dir 	= config.tmp_dir + "/" + p.title;
-			string tmp_zip 	= tmp_dir + ".zip";
-
-			Document doc;
-			bool is_data_missing = p.download_url.empty() || p.category.empty() || p.description.empty() || p.support_level.empty();
-			if(is_data_missing){
-				doc = rest_api::get_asset(url, p.asset_id, rest_api_params);
-				if(doc.HasParseError() || doc.IsNull()){
-					return log::error_rc(
-						ec::JSON_ERR,
-						std::format("package::install(): error parsing JSON: {}", 
-							GetParseError_En(doc.GetParseError()))
-					);
-				}
-				p.category			= doc["category"].GetString();
-				p.description 		= doc["description"].GetString();
-				p.support_level 	= doc["support_level"].GetString();
-				p.download_url 		= doc["download_url"].GetString();
-				p.download_hash 	= doc["download_hash"].GetString();
-				log::println("Done");
-			}
-			else{
-				log::println("");
-				log::info("Found asset data for \"{}\".", p.title);
-			}
-		
-			/* Make directories for packages if they don't exist to keep everything organized */
-			if(!std::filesystem::exists(config.tmp_dir))
-				std::filesystem::create_directories(config.tmp_dir);
-			if(!std::filesystem::exists(config.packages_dir))
-				std::filesystem::create_directories(config.packages_dir);
-
-			/* Dump asset information for lookup into JSON in package directory */
-			if(!std::filesystem::exists(package_dir))
-				std::filesystem::create_directory(package_dir);
-
-			std::ofstream ofs(package_dir + "/asset.json");
-			OStreamWrapper osw(ofs);
-			PrettyWriter<OStreamWrapper> writer(osw);
-			doc.Accept(writer);
-			target_extract_dirs.emplace_back(string_pair(tmp_zip, package_dir + "/"));
-
-			/* Check if we already have a stored temporary file before attempting to download */
-			if(std::filesystem::exists(tmp_zip) && std::filesystem::is_regular_file(tmp_zip)){
-				log::info("Found cached package for \"{}\".", p.title);
-			}
-			else{
-				p_download_urls.emplace_back(p.download_url);
-				p_storage_paths.emplace_back(tmp_zip);
-			}
-		}
-
-		/* Make sure the number of urls matches storage locations */
-		if(p_download_urls.size() != p_storage_paths.size()){
-			return log::error_rc(error(ec::ASSERTION_FAILED,
-				"package::install(): p_left.size() != p_storage.size()"
-			));
-		}
+		/* Each package is looked up, downloaded and extracted by its own task
+		on one event loop, so one package can be extracting while the others
+		are still downloading. The loop keeps up to `jobs` transfers going. */
+		std::error_code ec;
+		std::filesystem::create_directories(config.tmp_dir, ec);
+		std::filesystem::create_directories(config.packages_dir, ec);
 
-		/* Download ZIP files using download url */
-		if(config.jobs > 1){
-			http::context http(config.jobs);
-			http::responses responses = http.download_files(p_download_urls, p_storage_paths);
-			
-			/* Check for HTTP response errors */
-			for(const auto& r : responses){
-				if(r.code != http::OK){
-					log::error(error(ec::HTTP_RESPONSE_ERR,
-						std::format("HTTP error: {}", r.code)
-					));
-				}
-			}
+		std::vector<error> errors;
+		for(const auto& p : p_cache){
+			errors.emplace_back(ec::UNKNOWN, std::format("package::install(): could not install \"{}\".", p.title));
 		}
-		else{
-			http::context http;
-			for(size_t i = 0; i < p_download_urls.size(); i++){
-				http::response r = http.download_file(
-					p_download_urls[i], 
-					p_storage_paths[i]
-				);
-				if(r.code != http::OK){
-					log::error(error(ec::HTTP_RESPONSE_ERR,
-						std::format("HTTP error: {}", r.code)
-					));
-				}
+		{
+			http::loop loop(std::max(config.jobs, 1));
+			for(size_t i = 0; i < p_cache.size(); i++){
+				const string package_dir = config.packages_dir + "/" + p_cache[i].title;
+				const string tmp_zip = config.tmp_dir + "/" + p_cache[i].title + ".zip";
+				loop.spawn(_install_package(loop, config, p_cache[i], package_dir, tmp_zip, params, errors[i]));
 			}
+			loop.run();
 		}
 
-		/* Extract all the downloaded packages to their appropriate directory location. */
-		for(const auto& p : target_extract_dirs){
-			error error = utils::extract_zip(p.first.c_str(), p.second.c_str());
-			if(error.has_occurred()){
-				return error;
-			}
-			log::println("Done.");
+		/* Only mark the packages that made it through as installed */
+		package::info_list p_installed;
+		for(size_t i = 0; i < p_cache.size(); i++){
+			if(!errors[i].has_occurred())
+				p_installed.emplace_back(p_cache[i]);
 		}
-		
+		p_cache = std::move(p_installed);
+		auto failed = std::find_if(errors.begin(), errors.end(), 
+			[](const error& e){ return e.has_occurred(); }
+		);
+
 		/* Update the cache data */
 		for(auto& p : p_cache){
 			p.is_installed = true;
@@ -227,7 +224,7 @@ namespace gdpm::package{
 		}
 		log::println("Done.");
 
-		return error;
+		return (failed != errors.end()) ? *failed : error;
 	}
 
 
@@ -241,22 +238,9 @@ namespace gdpm::package{
 		/* Download and install package(s) in local project without storing
 		package info in the package database. This will check for packages stored
 		in local cache first. */
-		result_t result = cache::get_package_info_by_title(package_titles);
-		package::info_list p_found = {};
-		package::info_list p_cache = result.unwrap_unsafe();
 		log::debug("Searching for packages in cache...");
-		for(const auto& p_title : package_titles){
-			auto found = std::find_if(
-				p_cache.begin(), 
-				p_cache.end(), 
-				[&p_title](const package::info& p){ 
-					return p.title == p_title; 
-				}
-			);
-			if(found != p_cache.end()){
-				p_found.emplace_back(*found);
-			}
-		}
+		result_t result = cache::get_package_info_by_title(package_titles);
+		package::info_list p_found = result.unwrap_unsafe();
 
 		/* Install the ones found from cache first. */
 
@@ -267,113 +251,35 @@ namespace gdpm::package{
 			);
 		}
 
-		/* Install the other packages from remte source. */
-		std::vector<string_pair> dir_pairs;
-		task_list tasks;
-		rest_api::request_params rest_api_params = rest_api::make_from_config(config);
-		package::info_list p_left;
-		for(auto& p : p_found){	// TODO: Execute each in parallel using coroutines??
-
-			/* Check if a remote source was provided. If not, then try to get packages
-			in global storage location only. */
-
-			log::info("Fetching asset data for \"{}\"...", p.title);
-			string url{config.remote_sources.at(params.remote_source) + rest_api::endpoints::GET_AssetId};
-			string package_dir, tmp_dir, tmp_zip;
-
-			/* Retrieve necessary asset data if it was found already in cache */
-			Document doc;
-			bool is_missing_data = p.download_url.empty() || p.category.empty() || p.description.empty() || p.support_level.empty();
-			if(is_missing_data){
-				doc = rest_api::get_asset(url, p.asset_id, rest_api_params);
-				if(doc.HasParseError() || doc.IsNull()){
-					return log::error_rc(error(ec::JSON_ERR,
-						std::format("Error parsing JSON: {}", GetParseError_En(doc.GetParseError()))
-					));
-				}
-				p.category			= doc["category"].GetString();
-				p.description 		= doc["description"].GetString();
-				p.support_level 	= doc["support_level"].GetString();
-				p.download_url 		= doc["download_url"].GetString();
-				p.download_hash 	= doc["download_hash"].GetString();
-			}
-			else{
-				log::info("Found asset data found for \"{}\"", p.title);
-			}
-
-			/* Set directory and temp paths for storage */
-			package_dir = std::filesystem::current_path().string() + "/" + p.title;//config.packages_dir + "/" + p.title;
-			tmp_dir 	= std::filesystem::current_path().string() + "/" + p.title + ".tmp";
-			tmp_zip 	= tmp_dir + ".zip";
-
-			/* Make directories for packages if they don't exist to keep everything organized */
-			if(!std::filesystem::exists(config.tmp_dir))
-				std::filesystem::create_directories(config.tmp_dir);
-			if(!std::filesystem::exists(config.packages_dir))
-				std::filesystem::create_directories(config.packages_dir);
-
-			/* Dump asset information for lookup into JSON in package directory */
-			if(!std::filesystem::exists(package_dir))
-				std::filesystem::create_directory(package_dir);
-
-			std::ofstream ofs(package_dir + "/asset.json");
-			OStreamWrapper osw(ofs);
-			PrettyWriter<OStreamWrapper> writer(osw);
-			doc.Accept(writer);
-
-			/* Check if we already have a stored temporary file before attempting to download */
-			if(std::filesystem::exists(tmp_zip) && std::filesystem::is_regular_file(tmp_zip)){
-				log::info("Found cached package. Skipping download.", p.title);
-			}
-			else {
-				p_left.emplace_back(p);
-			}
-		} // for loop
-
-		/* Get the packages not found in cache and download */
+		/* Each package goes through the same pipeline as `install()`, but
+		into the current directory. */
+		const string current_dir = std::filesystem::current_path().string();
+		std::vector<error> errors;
+		for(const auto& p : p_found){
+			errors.emplace_back(ec::UNKNOWN, std::format("package::get(): could not get \"{}\".", p.title));
+		}
 		{
-			string_list urls;
-			for(const auto& p : p_left){
-				urls.emplace_back(p.download_url);
-			}
-			http::context http;
-			http::responses responses = http.requests(urls);
-
-			for(const auto& response : responses){
-				if(response.code == http::OK){
-					log::println("Done.");
-				}else{
-					return log::error_rc(error(ec::HTTP_RESPONSE_ERR,
-						std::format("HTTP Error: {}", response.code)
-					));
-				}
+			http::loop loop(std::max(config.jobs, 1));
+			for(size_t i = 0; i < p_found.size(); i++){
+				const string package_dir = current_dir + "/" + p_found[i].title;
+				const string tmp_zip = current_dir + "/" + p_found[i].title + ".tmp.zip";
+				loop.spawn(_install_package(loop, config, p_found[i], package_dir, tmp_zip, params, errors[i]));
 			}
+			loop.run();
 		}
 
-		/* Extract all packages and update cache database */
-		for(auto& p : p_found){
-			string package_dir = std::filesystem::current_path().string() + "/" + p.title;//config.packages_dir + "/" + p.title;
-			string tmp_dir 	= std::filesystem::current_path().string() + "/" + p.title + ".tmp";
-			string tmp_zip 	= tmp_dir + ".zip";
-
-			dir_pairs.emplace_back(string_pair(tmp_zip, package_dir + "/"));
-
-			p.is_installed = true;
-			p.install_path = package_dir;
-
-			/* Extract all the downloaded packages to their appropriate directory location. */
-			for(const auto& p : dir_pairs){
-				error error = utils::extract_zip(p.first.c_str(), p.second.c_str());
-			}
-
-			/* Remove temporary download archive */
-			for(const auto& p : p_found){
-				string tmp_zip = std::filesystem::current_path().string() 
-					+ "/" + p.title + ".tmp.zip";
-				std::filesystem::remove_all(tmp_zip);
-			}
+		/* Remove the temporary download archives of the packages that made
+		it, and keep the rest to resume from. */
+		for(size_t i = 0; i < p_found.size(); i++){
+			if(errors[i].has_occurred())
+				continue;
+			std::error_code ec;
+			std::filesystem::remove(current_dir + "/" + p_found[i].title + ".tmp.zip", ec);
 		}
-		return error();
+		auto failed = std::find_if(errors.begin(), errors.end(), 
+			[](const error& e){ return e.has_occurred(); }
+		);
+		return (failed != errors.end()) ? *failed : error();
 	}
 
 
@@ -568,11 +474,41 @@ namespace gdpm::package{
 		const package::title_list &package_titles,
 		const package::params& params
 	){
-		result_t r_cache = cache::get_package_info_by_title(package_titles);
-		info_list p_cache = r_cache.unwrap_unsafe();
-		
-		if(!p_cache.empty() && !config.enable_sync){
-			print_list(p_cache);
+		/* Search the local cache only without touching the network when
+		syncing is off or the cache was synced recently enough. */
+		if(params.offline || !config.enable_sync || is_sync_fresh(config, params)){
+			if(!params.offline && !config.enable_sync)
+				log::info("Showing cached results since syncing is disabled.");
+			else if(!params.offline)
+				log::info("Showing cached results synced in the last {}s. Pass --sync to search online.", config.sync_ttl);
+			auto print_results = [&config](const info_list& p_found){
+				if(config.style == print::style::table)
+					print_table(p_found);
+				else
+					print_list(p_found);
+			};
+			const int max_results = config.rest_api_params.max_results;
+			if(package_titles.empty()){
+				result_t r_cache = cache::search_package_info("", max_results);
+				if(r_cache.get_error().has_occurred())
+					return log::error_rc(r_cache.get_error());
+				print_results(r_cache.unwrap_unsafe());
+				return error();
+			}
+			for(const auto& p_title : package_titles){
+				result_t r_cache = cache::search_package_info(p_title, max_results);
+				error error = r_cache.get_error();
+				if(error.has_occurred()){
+					log::error(error);
+					continue;
+				}
+				info_list p_found = r_cache.unwrap_unsafe();
+				if(p_found.empty()){
+					log::info("No cached packages found matching '{}'.", p_title);
+					continue;
+				}
+				print_results(p_found);
+			}
 			return error();
 		}
 
@@ -715,27 +651,13 @@ namespace gdpm::package{
 
 		/* Check for packages in cache to link */
 		result_t r_cache = cache::get_package_info_by_title(package_titles);
-		info_list p_found = {};
-		info_list p_cache = r_cache.unwrap_unsafe();
-		if(p_cache.empty()){
+		info_list p_found = r_cache.unwrap_unsafe();
+		if(p_found.empty()){
 			return log::error_rc(error(ec::NOT_FOUND,
 				"Could not find any packages to link in cache."
 			));
 		}
 
-		for(const auto& p_title : package_titles){
-			auto found = std::find_if(p_cache.begin(), p_cache.end(), [&p_title](const package::info& p){ return p.title == p_title; });
-			if(found != p_cache.end()){
-				p_found.emplace_back(*found);
-			}
-		}
-
-		if(p_found.empty()){
-			return log::error_rc(error(ec::NO_PACKAGE_FOUND,
-				"No packages found to link."
-			));
-		}
-
 		/* Get the storage paths for all packages to create symlinks */
 		const path package_dir{config.packages_dir};
 		for(const auto& p : p_found){
@@ -774,31 +696,12 @@ namespace gdpm::package{
 		}
 
 		result_t r_cache = cache::get_package_info_by_title(package_titles);
-		package::info_list p_found = {};
-		package::info_list p_cache = r_cache.unwrap_unsafe();
+		package::info_list p_found = r_cache.unwrap_unsafe();
 
 		/* Check for installed packages to clone */
-		if(p_cache.empty()){
-			return log::error_rc(error(ec::NO_PACKAGE_FOUND,
-				"Could not find any packages to clone in cache."
-			));
-		}
-
-		for(const auto& p_title : package_titles){
-			auto found = std::find_if(
-				p_cache.begin(), 
-				p_cache.end(), 
-				[&p_title](const package::info& p){ 
-					return p.title == p_title; 
-			});
-			if(found != p_cache.end()){
-				p_found.emplace_back(*found);
-			}
-		}
-
 		if(p_found.empty()){
 			return log::error_rc(error(ec::NO_PACKAGE_FOUND,
-				"No packages found to clone."
+				"Could not find any packages to clone in cache."
 			));
 		}
 
@@ -821,29 +724,264 @@ namespace gdpm::package{
 	}
 
 
+	info _from_asset_list_item(
+		const rapidjson::Value& o,
+		const string& remote_source
+	){
+		return info{
+			.asset_id 		= std::stoul(o["asset_id"].GetString()),
+			.title 			= o["title"].GetString(),
+			.author 		= o["author"].GetString(),
+			.author_id 		= std::stoul(o["author_id"].GetString()),
+			.version 		= o["version"].GetString(),
+			.godot_version 	= o["godot_version"].GetString(),
+			.cost 			= o["cost"].GetString(),
+			.modify_date 	= o["modify_date"].GetString(),
+			.category		= o["category"].GetString(),
+			.remote_source	= remote_source
+		};
+	}
+
+
+	error _fetch_targeted(
+		const config::context& config,
+		const title_list& package_titles,
+		const string& url
+	){
+		using namespace rapidjson;
+
+		/* Query the asset list filtered by each title a few at a time and only
+		keep the exact matches. The catalog sync state isn't touched since
+		this doesn't see the rest of the assets. */
+		rest_api::request_params rest_api_params = rest_api::make_from_config(config);
+		rest_api_params.page = 0;
+		const size_t max_jobs = std::max(config.jobs, 1);
+		info_list packages;
+		size_t failed = 0;
+
+		log::info_n("Sychronizing {} package(s)...", package_titles.size());
+		for(size_t i = 0; i < package_titles.size(); i += max_jobs){
+			_task_list<Document> tasks;
+			const size_t end = std::min(i + max_jobs, package_titles.size());
+			for(size_t j = i; j < end; j++){
+				tasks.emplace_back(std::async(std::launch::async,
+					[&url, &rest_api_params, &p_title = package_titles[j]](){
+						return rest_api::get_assets_list(url, rest_api_params, p_title);
+					}
+				));
+			}
+			for(size_t j = i; j < end; j++){
+				Document doc = tasks[j - i].get();
+				if(doc.IsNull() || !doc.HasMember("result")){
+					failed++;
+					continue;
+				}
+				for(const auto& o : doc["result"].GetArray()){
+					if(package_titles[j] == o["title"].GetString())
+						packages.emplace_back(_from_asset_list_item(o, url));
+				}
+			}
+		}
+
+		result_t r_upsert = cache::upsert_package_info(packages);
+		error error = r_upsert.get_error();
+		if(error.has_occurred()){
+			log::println("");
+			return log::error_rc(error);
+		}
+		log::println("Done.");
+		if(failed > 0){
+			log::warn("Could not get a response for {} of {} package(s).",
+				failed, package_titles.size()
+			);
+		}
+		if(config.verbose > 0){
+			log::info("Synchronized {} of {} requested package(s).",
+				packages.size(), package_titles.size()
+			);
+		}
+		return error;
+	}
+
+
+	/* The asset list of the configured remote, which is also what cached
+	assets and the sync state are kept under. */
+	string _get_asset_list_url(const config::context& config, const params& params){
+		string host = (config.remote_sources.contains(params.remote_source))
+			? config.remote_sources.at(params.remote_source)
+			: constants::HostUrl;
+		return host + rest_api::endpoints::GET_Asset;
+	}
+
+
+	int _get_page_count(const rapidjson::Value& doc){
+		/* Older servers only send the totals, so derive the count from them */
+		if(doc.HasMember("pages"))
+			return doc["pages"].GetInt();
+		int total_items = doc["total_items"].GetInt();
+		int page_length = std::max(doc["page_length"].GetInt(), 1);
+		return (total_items + page_length - 1) / page_length;
+	}
+
+
+	error _fetch_pages(
+		const config::context& config,
+		const string& url,
+		const rest_api::request_params& rest_api_params,
+		int first_page,
+		int total_pages,
+		const std::function<error(const rapidjson::Document&)>& store_page,
+		cache::sync_state& state
+	){
+		/* Pages are staged in whatever order they arrive. The checkpoint only
+		moves past a page once every page before it was staged, so a resumed
+		sync never skips one. */
+		std::vector<int> pages;
+		for(int page = first_page; page < total_pages; page++)
+			pages.emplace_back(page);
+
+		std::set<int> staged;
+		size_t failed = 0;
+		error page_error;
+		error error = rest_api::multi::get_assets_list(url, rest_api_params, pages,
+			[&](int page, rapidjson::Document& doc){
+				if(page_error.has_occurred())
+					return;
+				if(doc.IsNull() || !doc.HasMember("result")){
+					failed++;
+					return;
+				}
+				page_error = store_page(doc);
+				if(page_error.has_occurred())
+					return;
+				staged.insert(page);
+				int checkpoint_page = state.checkpoint.page;
+				while(staged.erase(checkpoint_page + 1))
+					checkpoint_page++;
+				if(checkpoint_page != state.checkpoint.page){
+					state.checkpoint.page = checkpoint_page;
+					gdpm::error error = cache::set_sync_state(state);
+					if(error.has_occurred())
+						log::error(error);
+				}
+			},
+			config.jobs
+		);
+		if(error.has_occurred())
+			return error;
+		if(page_error.has_occurred())
+			return page_error;
+		if(failed > 0){
+			return gdpm::error(ec::EMPTY_RESPONSE,
+				std::format("Could not get {} of {} page(s) from server. Aborting.", failed, pages.size())
+			);
+		}
+		return error;
+	}
+
+
 	result_t<info_list> fetch(
 		const config::context& config,
-		const title_list& package_titles
+		const title_list& package_titles,
+		const params& params
 	){
 		using namespace rapidjson;
 
+		string url = _get_asset_list_url(config, params);
+		if(params.sync_method == SYNC_TARGETED && !package_titles.empty()){
+			error error = _fetch_targeted(config, package_titles, url);
+			if(error.has_occurred())
+				return result_t(info_list(), error);
+			return cache::get_package_info_by_title(package_titles);
+		}
+
 		rest_api::request_params rest_api_params = rest_api::make_from_config(config);
 		rest_api_params.page 	= 0;
 		int page 				= 0;
 		int page_length 		= 0;
 		int total_items 		= 0;
 		int items_left 			= 0;
-		// int total_pages = 0;
+		int total_pages 		= 0;
+		cache::insert_stats insert_total;
+		std::set<int> totals_seen;
+		int latest_total		= 0;
+		int latest_pages		= 0;
+
+		/* Use the newest modify_date from the last sync as a high-water mark.
+		Assets are requested newest first so paging can stop as soon as one
+		older than the mark shows up. Without a mark, do a full sync. */
+		result_t r_state = cache::get_sync_state(url);
+		if(r_state.get_error().has_occurred())
+			return result_t(info_list(), log::error_rc(r_state.get_error()));
+		cache::sync_state state = r_state.unwrap_unsafe();
+		const string watermark = state.newest_modify_date;
+
+		/* An unfinished full sync made with the same query is resumed from
+		the page after the last one that was staged. */
+		const string query = rest_api::_prepare_request(url, rest_api_params, "");
+		bool is_resume = state.checkpoint.is_set() && state.checkpoint.query == query;
+		const bool is_delta = params.sync_method == SYNC_DELTA && !watermark.empty() && !is_resume;
+		bool reached_watermark = false;
+		if(is_delta){
+			rest_api_params.sort 	= rest_api::sort_e::updated;
+			rest_api_params.reverse = false;
+			state.checkpoint 		= cache::sync_checkpoint();
+			if(config.verbose > 0)
+				log::info("Fetching assets updated since {}.", watermark);
+		}
+		else if(is_resume){
+			rest_api_params.page = state.checkpoint.page + 1;
+			log::info("Resuming synchronization from page {}.", rest_api_params.page);
+		}
+		else{
+			/* Full syncs are written to a staging table and swapped in at the
+			end so readers never see a partially synced catalog. */
+			error error = cache::clear_staged_packages(url);
+			if(error.has_occurred())
+				return result_t(info_list(), log::error_rc(error));
+			state.checkpoint = cache::sync_checkpoint{ .query = query };
+		}
+
+		/* Stage or upsert the assets on a page and add them to the totals. */
+		auto store_page = [&](const Document& doc) -> error {
+			if(doc.HasMember("total_items")){
+				latest_total = doc["total_items"].GetInt();
+				latest_pages = _get_page_count(doc);
+				totals_seen.insert(latest_total);
+			}
+			info_list packages;
+			for(const auto& o : doc["result"].GetArray()){
+				if(is_delta && watermark > o["modify_date"].GetString()){
+					reached_watermark = true;
+					break;
+				}
+				info p = _from_asset_list_item(o, url);
+				state.checkpoint.newest_modify_date = std::max(state.checkpoint.newest_modify_date, p.modify_date);
+				packages.emplace_back(p);
+			}
+
+			/* Delta syncs update rows in place, which is safe since they only
+			touch a few rows and never remove any. */
+			result_t r_upsert = (is_delta)
+				? cache::upsert_package_info(packages)
+				: cache::stage_package_info(packages);
+			if(r_upsert.get_error().has_occurred())
+				return r_upsert.get_error();
+			cache::insert_stats stats = r_upsert.unwrap_unsafe();
+			insert_total.rows 		+= stats.rows;
+			insert_total.changed 	+= stats.changed;
+			insert_total.seconds 	+= stats.seconds;
+			return error();
+		};
 
 		log::info_n("Sychronizing database...");
 		do{
 			/* Make the GET request to get page data and store it in the local 
 			package database. Also, check to see if we need to keep going. */
-			string url{constants::HostUrl + rest_api::endpoints::GET_Asset};
 			Document doc = rest_api::get_assets_list(url, rest_api_params);
 			rest_api_params.page += 1;
 
-			if(doc.IsNull()){
+			if(doc.IsNull() || !doc.HasMember("result")){
 				log::println("");
 				return result_t(info_list(), log::error_rc(
 					ec::EMPTY_RESPONSE,
@@ -855,53 +993,166 @@ namespace gdpm::package{
 			request. */
 			page 		= doc["page"].GetInt();
 			page_length = doc["page_length"].GetInt();
-			// total_pages = doc["pages"].GetInt();
 			total_items = doc["total_items"].GetInt();
+			total_pages = _get_page_count(doc);
 			items_left 	= total_items - (page + 1) * page_length;
 
-			// log::info("page: {}, page length: {}, total pages: {}, total items: {}, items left: {}", page, page_length, total_pages, total_items, items_left);
+			/* Pages shift when assets are added or removed, so start over if
+			the catalog changed since the checkpoint was saved. */
+			if(is_resume && total_items != state.checkpoint.total_items){
+				log::warn("Remote asset list changed since the last sync. Restarting synchronization.");
+				error error = cache::clear_staged_packages(url);
+				if(error.has_occurred())
+					return result_t(info_list(), log::error_rc(error));
+				state.checkpoint 		= cache::sync_checkpoint{ .query = query };
+				rest_api_params.page 	= 0;
+				is_resume 				= false;
+				items_left 				= 1;
+				continue;
+			}
+			is_resume = false;
 
-			if(page == 0){
-				error error;
-				error = cache::drop_package_database();
-				error = cache::create_package_database();
+			error error = store_page(doc);
+			if (error.has_occurred()){
+				log::println("");
+				return result_t(info_list(), log::error_rc(error));
 			}
 
-			info_list packages;
-			for(const auto& o : doc["result"].GetArray()){
-				// log::println("=======================");
-				info p{
-					.asset_id 		= std::stoul(o["asset_id"].GetString()),
-					.title 			= o["title"].GetString(),
-					.author 		= o["author"].GetString(),
-					.author_id 		= std::stoul(o["author_id"].GetString()),
-					.version 		= o["version"].GetString(),
-					.godot_version 	= o["godot_version"].GetString(),
-					.cost 			= o["cost"].GetString(),
-					.modify_date 	= o["modify_date"].GetString(),
-					.category		= o["category"].GetString(),
-					.remote_source	= url
-				};
-				packages.emplace_back(p);
+			/* Save progress so an interrupted full sync can pick up here */
+			if(!is_delta){
+				state.checkpoint.page 			= page;
+				state.checkpoint.total_items 	= total_items;
+				error = cache::set_sync_state(state);
+				if(error.has_occurred())
+					log::error(error);
 			}
-			error error = cache::insert_package_info(packages);
-			if (error.has_occurred()){
-				log::error(error);
-				/* FIXME: Should this stop here or keep going? */
+
+			/* A full sync has to read every page, so once the first response
+			gives the page count the rest are requested concurrently. Delta
+			syncs stay sequential since they stop at the high-water mark. */
+			if(!is_delta && config.jobs > 1 && items_left > 0){
+				error = _fetch_pages(config, url, rest_api_params, page + 1, total_pages, store_page, state);
+				if(error.has_occurred()){
+					log::println("");
+					return result_t(info_list(), log::error_rc(error));
+				}
+				break;
+			}
+		} while(items_left > 0 && !reached_watermark);
+
+		/* Assets added or removed while paging shift the pages after them,
+		so some assets come back twice and others not at all. Page through
+		once more with the new total. Staging keeps one row per asset, so
+		both passes together cover every asset that is still listed. */
+		if(!is_delta && totals_seen.size() > 1){
+			log::warn("Remote asset list changed during synchronization. Fetching it again.");
+			total_items 					= latest_total;
+			state.checkpoint.page 			= -1;
+			state.checkpoint.total_items 	= latest_total;
+			error error = _fetch_pages(config, url, rest_api_params, 0, latest_pages, store_page, state);
+			if(error.has_occurred()){
+				log::println("");
+				return result_t(info_list(), log::error_rc(error));
 			}
-			/* Make the same request again to get the rest of the needed data 
-			using the same request, but with a different page, then update 
-			variables as needed. */
+		}
 
+		/* Only swap once every page of a full sync was read so assets that
+		simply weren't requested yet are never deleted. */
+		size_t removed = 0;
+		if(!is_delta){
+			result_t r_swap = cache::swap_staged_packages(url, total_items);
+			if(r_swap.get_error().has_occurred()){
+				log::println("");
+				return result_t(info_list(), log::error_rc(r_swap.get_error()));
+			}
+			/* Pages fetched twice stage some assets twice, so take the counts
+			from the swap instead. */
+			cache::swap_stats stats = r_swap.unwrap_unsafe();
+			insert_total.rows 		= stats.rows;
+			insert_total.changed 	= stats.changed;
+			insert_total.seconds 	+= stats.seconds;
+			removed 				= stats.removed;
+		}
 
-		} while(items_left > 0);
+		state.newest_modify_date = std::max(state.newest_modify_date, state.checkpoint.newest_modify_date);
+		state.checkpoint = cache::sync_checkpoint();
+		state.last_synced = std::chrono::duration_cast<std::chrono::seconds>(
+			std::chrono::system_clock::now().time_since_epoch()
+		).count();
+		error error = cache::set_sync_state(state);
+		if(error.has_occurred())
+			log::error(error);
 
 		log::println("Done.");
+		if(config.verbose > 0){
+			log::info("Synchronized {} assets in {:.3f}s ({:.0f} rows/sec): {} changed, {} removed.",
+				insert_total.rows, insert_total.seconds, insert_total.rows_per_second(),
+				insert_total.changed, removed
+			);
+		}
 
 		return cache::get_package_info_by_title(package_titles);
 	}
 
 
+	task<error> fetch_asset_details(
+		http::loop& loop,
+		const config::context& config,
+		info& p,
+		json::document& doc,
+		package::params params
+	){
+		using namespace rapidjson;
+
+		if(!config.remote_sources.contains(params.remote_source)){
+			co_return error(ec::NOT_FOUND,
+				"package::fetch_asset_details(): remote source not found in config."
+			);
+		}
+		bool is_data_missing = p.download_url.empty() || p.category.empty() || p.description.empty() || p.support_level.empty();
+		if(!is_data_missing){
+			log::info("Found asset data for \"{}\".", p.title);
+			co_return error();
+		}
+
+		log::info("Fetching asset data for \"{}\"...", p.title);
+		string url{config.remote_sources.at(params.remote_source) + rest_api::endpoints::GET_AssetId};
+		doc = co_await rest_api::async::get_asset(loop, url, p.asset_id, rest_api::make_from_config(config));
+		if(doc.HasParseError() || !doc.IsObject() || !doc.HasMember("download_url")){
+			co_return error(ec::JSON_ERR,
+				std::format("package::fetch_asset_details(): could not get asset data for \"{}\": {}",
+					p.title, GetParseError_En(doc.GetParseError()))
+			);
+		}
+		p.category			= doc["category"].GetString();
+		p.description 		= doc["description"].GetString();
+		p.support_level 	= doc["support_level"].GetString();
+		p.download_url 		= doc["download_url"].GetString();
+		p.download_hash 	= doc["download_hash"].GetString();
+		co_return error();
+	}
+
+
+	bool is_sync_fresh(const config::context& config, const params& params){
+		if(config.force_sync || config.sync_ttl <= 0)
+			return false;
+
+		result_t r_state = cache::get_sync_state(_get_asset_list_url(config, params));
+		if(r_state.get_error().has_occurred())
+			return false;
+
+		std::int64_t now = std::chrono::duration_cast<std::chrono::seconds>(
+			std::chrono::system_clock::now().time_since_epoch()
+		).count();
+		std::int64_t age = now - r_state.unwrap_unsafe().last_synced;
+		if(age >= 0 && age < config.sync_ttl){
+			log::debug("package::is_sync_fresh(): last synced {}s ago, skipping sync.", age);
+			return true;
+		}
+		return false;
+	}
+
+
 	void print_list(const info_list& packages){
 		for(const auto& p : packages){
 			log::println(
@@ -1068,44 +1319,17 @@ namespace gdpm::package{
 		/* Download and install package(s) in local project without storing
 		package info in the package database. This will check for packages stored
 		in local cache first. */
-		result_t result = cache::get_package_info_by_title(package_titles);
-		package::info_list p_found = {};
-		package::info_list p_cache = result.unwrap_unsafe();
 		log::debug("Searching for packages in cache...");
-		for(const auto& p_title : package_titles){
-			auto found = std::find_if(
-				p_cache.begin(), 
-				p_cache.end(), 
-				[&p_title](const package::info& p){ 
-					return p.title == p_title; 
-				}
-			);
-			if(found != p_cache.end()){
-				p_found.emplace_back(*found);
-			}
-		}
-		return p_found;
+		result_t result = cache::get_package_info_by_title(package_titles);
+		return result.unwrap_unsafe();
 	}
 
 	
 	info_list find_installed_packages(const title_list& package_titles){
-		result_t result = cache::get_package_info_by_title(package_titles);
-		package::info_list p_installed = {};
-		package::info_list p_cache = result.unwrap_unsafe();
 		log::debug("Searching for installed packages in cache...");
-		for(const auto& p_title : package_titles){
-			auto found = std::find_if(
-				p_cache.begin(), 
-				p_cache.end(), 
-				[&p_title](const package::info& p){ 
-					return p.title == p_title && p.is_installed; 
-				}
-			);
-			if(found != p_cache.end()){
-				p_installed.emplace_back(*found);
-			}
-		}
-
+		result_t result = cache::get_package_info_by_title(package_titles);
+		package::info_list p_installed = result.unwrap_unsafe();
+		std::erase_if(p_installed, [](const package::info& p){ return !p.is_installed; });
 		return p_installed;
 	}
 
@@ -55,9 +55,17 @@ namespace gdpm::package_manager{
 		if(error.has_occurred()){
 			return log::error_rc(error);
 		}
-
-		/* Create the local databases if it doesn't exist already */
-		error = cache::create_package_database();
+		http::initialize(http::settings{
+			.max_host_streams = config.max_host_streams,
+			.max_host_rate = (double)config.max_host_rate
+		});
+
+		/* Create the local databases if it doesn't exist already and apply
+		any pending schema migrations */
+		error = cache::initialize(cache::params{
+			.busy_timeout = config.busy_timeout,
+			.max_readers = std::max<size_t>(config.jobs, GDPM_PACKAGE_CACHE_MAX_READERS)
+		});
 		if(error.has_occurred()){
 			return log::error_rc(error);
 		}
@@ -68,6 +76,8 @@ namespace gdpm::package_manager{
 
 	error finalize(){
 		curl_easy_cleanup(curl);
+		http::cleanup();
+		cache::close_databases();
 		error error = config::save(config.path, config);
 		return error;
 	}
@@ -236,6 +246,11 @@ namespace gdpm::package_manager{
 			.default_value(false)
 			.nargs(0);
 		update_command.add_argument("--remote");
+		update_command.add_argument("--sync")
+			.help("sync with remote even if the cache is still fresh")
+			.implicit_value(true)
+			.default_value(false)
+			.nargs(0);
 		update_command.add_argument("-f", "--file")
 			.help("set the file(s) to read as input")
 			.append()
@@ -269,6 +284,16 @@ namespace gdpm::package_manager{
 			.help("set the file(s) to read as input")
 			.append()
 			.nargs(nargs_pattern::at_least_one);
+		search_command.add_argument("--sync")
+			.help("search remote even if the cache is still fresh")
+			.implicit_value(true)
+			.default_value(false)
+			.nargs(0);
+		search_command.add_argument("--offline")
+			.help("search the local package cache only")
+			.implicit_value(true)
+			.default_value(false)
+			.nargs(0);
 		search_command.add_argument("--style")
 			.help("set how to print output")
 			.nargs(1)
@@ -343,6 +368,11 @@ namespace gdpm::package_manager{
 		fetch_command.add_argument("remote")
 			.help("remote to fetch")
 			.nargs(nargs_pattern::any);
+		fetch_command.add_argument("--full")
+			.help("fetch every asset instead of only the ones updated since the last sync")
+			.implicit_value(true)
+			.default_value(false)
+			.nargs(0);
 
 		config_get.add_description("get config properties");
 		config_get.add_argument("properties")
@@ -443,6 +473,7 @@ namespace gdpm::package_manager{
 				string sync = install_command.get<string>("sync");
 				if(!sync.compare("enable") || !sync.compare("true") || sync.empty()){
 					config.enable_sync = true;
+					config.force_sync = true;
 				}
 				else if(!sync.compare("disable") || !sync.compare("false")){
 					config.enable_sync = false;
@@ -479,6 +510,8 @@ namespace gdpm::package_manager{
 			set_if_used(update_command, config.clean_temporary, "clean");
 			set_if_used(update_command, params.remote_source, "remote");
 			set_if_used(update_command, params.input_files, "file");
+			if(update_command.get<bool>("sync"))
+				config.force_sync = true;
 		}
 		else if(program.is_subcommand_used(search_command)){
 			action = action_e::search;
@@ -486,6 +519,12 @@ namespace gdpm::package_manager{
 			set_if_used(search_command, config.rest_api_params.godot_version, "godot-version");
 			set_if_used(search_command, params.remote_source, "remote");
 			set_if_used(search_command, params.input_files, "file");
+			if(search_command.is_used("max-results"))
+				config.rest_api_params.max_results = std::stoi(search_command.get<string>("max-results"));
+			if(search_command.get<bool>("sync"))
+				config.force_sync = true;
+			if(search_command.get<bool>("offline"))
+				params.offline = true;
 			if(search_command.is_used("style")){
 				string style = search_command.get<string>("style");
 				if(!style.compare("list"))
@@ -573,6 +612,8 @@ namespace gdpm::package_manager{
 			action = action_e::fetch;
 			if(fetch_command.is_used("remote"))
 				params.remote_source = fetch_command.get("remote");
+			if(fetch_command.get<bool>("full"))
+				params.sync_method = package::SYNC_FULL;
 		}
 		else if(program.is_subcommand_used(version_command)){
 			action = action_e::version;
@@ -624,8 +665,8 @@ namespace gdpm::package_manager{
 			case action_e::clean:			package::clean(config, package_titles); break;
 			case action_e::config_get:		config::print_properties(config, params.args); break;
 			case action_e::config_set:		config::set_property(config, params.args[0], params.args[1]); break;
-			case action_e::fetch:			package::fetch(config, package_titles); break;
-			case action_e::sync: 			package::fetch(config, package_titles); break;
+			case action_e::fetch:			package::fetch(config, package_titles, params); break;
+			case action_e::sync: 			package::fetch(config, package_titles, params); break;
 			case action_e::remote_list:		remote::print_repositories(config); break;
 			case action_e::remote_add: 		remote::add_repository(config, params.args); break;
 			case action_e::remote_remove: 	remote::remove_respositories(config, params.args); break;
@@ -163,9 +163,11 @@ namespace gdpm::rest_api{
 		int verbose
 	){
 		http::context http;
+		http::request params;
+		params.use_cache = true;
 		string request_url{url};
 		request_url += to_string(type);
-		http::response r = http.request(url);
+		http::response r = http.request(url, params);
 		if(verbose > 0)
 			log::info("rest_api::configure::url: {}", url);
 		return _parse_json(r.body);
@@ -180,13 +182,14 @@ namespace gdpm::rest_api{
 		http::context http;
 		http::request params;
 		params.headers.insert(http::header("Accept", "*/*"));
-		params.headers.insert(http::header("Accept-Encoding", "application/gzip"));
-		params.headers.insert(http::header("Content-Encoding", "application/gzip"));
 		params.headers.insert(http::header("Connection", "keep-alive"));
+		params.use_cache = true;
 		string prepared_url = _prepare_request(url, c, http.url_escape(filter));
 		http::response r = http.request(prepared_url, params);
-		if(c.verbose >= log::INFO)
+		if(c.verbose >= log::INFO){
 			log::info("rest_api::get_asset_list()::url: {}", prepared_url);
+			log::info("rest_api::get_asset_list(): received {} bytes ({} decoded)", r.bytes_received, r.bytes_decoded);
+		}
 		return _parse_json(r.body, c.verbose);
 	}
 
@@ -201,9 +204,8 @@ namespace gdpm::rest_api{
 		http::context http;
 		http::request params;
 		params.headers.insert(http::header("Accept", "*/*"));
-		params.headers.insert(http::header("Accept-Encoding", "application/gzip"));
-		params.headers.insert(http::header("Content-Encoding", "application/gzip"));
 		params.headers.insert(http::header("Connection", "keep-alive"));
+		params.use_cache = true;
 		string prepared_url = utils::replace_all(
 			_prepare_request(url, api_params, 
 				http.url_escape(filter)
@@ -215,6 +217,30 @@ namespace gdpm::rest_api{
 	}
 
 
+	namespace async{
+		task<json::document> get_asset(
+			http::loop& loop,
+			string url,
+			int asset_id,
+			request_params api_params,
+			string filter
+		){
+			http::request params;
+			params.headers.insert(http::header("Accept", "*/*"));
+			params.headers.insert(http::header("Connection", "keep-alive"));
+			params.use_cache = true;
+			string prepared_url = utils::replace_all(
+				_prepare_request(url, api_params, 
+					loop.url_escape(filter)
+				), "{id}", std::to_string(asset_id));
+			if(api_params.verbose >= log::INFO)
+				log::info("rest_api::async::get_asset()::url: {}", prepared_url);
+			http::response r = co_await loop.get(prepared_url, params);
+			co_return _parse_json(r.body, api_params.verbose);
+		}
+	}
+
+
 	bool delete_asset(int asset_id){
 		return false;
 	}
@@ -235,19 +261,21 @@ namespace gdpm::rest_api{
 			const string_list& urls,
 			id_list asset_ids,
 			const request_params& api_params,
-			const string_list& filters
+			const string_list& filters,
+			int max_transfers
 		){
-			if(urls.size() == asset_ids.size() && urls.size() == filters.size()){
+			if(urls.size() != asset_ids.size() || urls.size() != filters.size()){
 				log::error(error(ec::ASSERTION_FAILED,
 					"multi::get_assets(): urls.size() != filters.size()"));
+				return json::documents();
 			}
-			http::context http(4);
+			http::context http(max_transfers);
 			http::request params;
-			json::documents docs;
+			json::documents docs(urls.size());
 			params.headers.insert(http::header("Accept", "*/*"));
-			params.headers.insert(http::header("Accept-Encoding", "application/gzip"));
-			params.headers.insert(http::header("Content-Encoding", "application/gzip"));
 			params.headers.insert(http::header("Connection", "keep-alive"));
+			params.use_cache = true;
+			params.retry.hedge = true;
 			string_list prepared_urls = {};
 			
 			/* Prepare the URLs for the request_multi() call z*/
@@ -263,13 +291,52 @@ namespace gdpm::rest_api{
 					log::info("get_assets(i={})::url: {}", i, prepared_url);
 			}
 			
-			/* Parse JSON string into objects */
-			http::responses responses = http.requests(prepared_urls, params);
-			for(const auto& response : responses){
-				docs.emplace_back(_parse_json(response.body));
-			}
+			/* Parse JSON string into objects as each response arrives */
+			http.requests(prepared_urls,
+				[&docs, &api_params](size_t i, http::response& r){
+					if(r.code == http::OK && !r.body.empty())
+						docs[i] = _parse_json(r.body, api_params.verbose);
+				},
+				params
+			);
 			return docs;
 		}
+
+
+		error get_assets_list(
+			const string& url,
+			const request_params& c,
+			const std::vector<int>& pages,
+			const page_callback& on_page,
+			int max_transfers,
+			const string& filter
+		){
+			http::context http(max_transfers);
+			http::request params;
+			params.headers.insert(http::header("Accept", "*/*"));
+			params.headers.insert(http::header("Connection", "keep-alive"));
+			params.use_cache = true;
+			params.retry.hedge = true;
+
+			string_list prepared_urls;
+			request_params page_params = c;
+			for(int page : pages){
+				page_params.page = page;
+				prepared_urls.emplace_back(_prepare_request(url, page_params, http.url_escape(filter)));
+				if(c.verbose >= log::INFO)
+					log::info("rest_api::multi::get_assets_list()::url: {}", prepared_urls.back());
+			}
+
+			return http.requests(prepared_urls,
+				[&pages, &on_page, &c](size_t i, http::response& r){
+					json::document doc;
+					if(r.code == http::OK && !r.body.empty())
+						doc = _parse_json(r.body, c.verbose);
+					on_page(pages[i], doc);
+				},
+				params
+			);
+		}
 	}
 
 	namespace edits{
@@ -5,8 +5,161 @@
 #include "cache.hpp"
 #include "config.hpp"
 #include "package.hpp"
+#include "http.hpp"
 
 #include <doctest.h>
+#include <filesystem>
+#include <fstream>
+#include <ctime>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+/* Serves HTTP/1.1 on localhost for the tests that need more than file://.
+Every connection gets the one response `handler` returns for its request
+head, and is closed after. */
+struct test_server{
+	using handler_t = std::function<std::string(const std::string& request)>;
+
+	test_server(handler_t handler): handler(std::move(handler)){
+		sockaddr_in addr{};
+		socklen_t addr_len = sizeof(addr);
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		bind(fd, (sockaddr*)&addr, sizeof(addr));
+		listen(fd, 16);
+		getsockname(fd, (sockaddr*)&addr, &addr_len);
+		port = ntohs(addr.sin_port);
+		thread = std::thread([this](){
+			for(int c; (c = accept(fd, nullptr, nullptr)) >= 0; close(c)){
+				std::string request;
+				char buffer[4096];
+				while(request.find("\r\n\r\n") == std::string::npos){
+					ssize_t n = recv(c, buffer, sizeof(buffer), 0);
+					if(n <= 0)
+						break;
+					request.append(buffer, n);
+				}
+				std::string response = this->handler(request);
+				for(size_t sent = 0; sent < response.size();){
+					ssize_t n = send(c, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+					if(n <= 0)
+						break;
+					sent += n;
+				}
+			}
+		});
+	}
+	~test_server(){
+		/* Wakes up the blocked accept() */
+		shutdown(fd, SHUT_RDWR);
+		close(fd);
+		thread.join();
+	}
+
+	std::string url(const std::string& path) const {
+		return std::format("http://127.0.0.1:{}{}", port, path);
+	}
+
+	static std::string get_header(const std::string& request, const std::string& name){
+		size_t begin = request.find("\r\n" + name + ": ");
+		if(begin == std::string::npos)
+			return "";
+		begin += name.size() + 4;
+		return request.substr(begin, request.find("\r\n", begin) - begin);
+	}
+
+	/* Answers to HEAD requests describe `body` without sending it */
+	static std::string make_response(const std::string& status, const std::string& headers, const std::string& body = "", bool has_body = true){
+		return std::format("HTTP/1.1 {}\r\nContent-Length: {}\r\nConnection: close\r\n{}\r\n{}", 
+			status, body.size(), headers, (has_body) ? body : "");
+	}
+
+	handler_t handler;
+	int fd = -1;
+	int port = 0;
+	std::thread thread;
+};
+
+
+/* Answers asset list queries like the asset library, `page_length` assets
+a page, in the order of `assets` or newest first with `sort=updated`. Pages
+in `failing_pages` fail and `after_page` can change the catalog between
+requests. */
+struct test_asset_library{
+	struct asset{
+		int id;
+		std::string title;
+		std::string modify_date;
+	};
+
+	std::vector<asset> assets;
+	int page_length = 2;
+	std::set<int> failing_pages;
+	std::vector<std::string> queries;
+	std::function<void(int page)> after_page;
+	std::mutex mutex;
+	test_server server{[this](const std::string& request){ return respond(request); }};
+
+	std::string host() const { return server.url(""); }
+
+	static std::string get_param(const std::string& query, const std::string& name){
+		for(char separator : {'?', '&'}){
+			size_t begin = query.find(separator + name + "=");
+			if(begin == std::string::npos)
+				continue;
+			begin += name.size() + 2;
+			return query.substr(begin, query.find('&', begin) - begin);
+		}
+		return "";
+	}
+
+	std::string respond(const std::string& request){
+		std::lock_guard lock(mutex);
+		std::string query = request.substr(4, request.find(" HTTP/") - 4);
+		std::string page_param = get_param(query, "page");
+		std::string filter = get_param(query, "filter");
+		int page = (page_param.empty()) ? 0 : std::stoi(page_param);
+		queries.emplace_back(query);
+		if(failing_pages.contains(page))
+			return test_server::make_response("500 Internal Server Error", "");
+
+		std::vector<asset> listed;
+		for(const asset& a : assets){
+			if(a.title.find(filter) != std::string::npos)
+				listed.emplace_back(a);
+		}
+		if(query.find("sort=updated") != std::string::npos){
+			std::stable_sort(listed.begin(), listed.end(), [](const asset& a, const asset& b){
+				return a.modify_date > b.modify_date;
+			});
+		}
+		std::string result;
+		for(size_t i = page * page_length; i < listed.size() && i < (size_t)(page + 1) * page_length; i++){
+			const asset& a = listed[i];
+			result += std::format(
+				"{}{{\"asset_id\":\"{}\",\"title\":\"{}\",\"author\":\"test\",\"author_id\":\"1\","
+				"\"version\":\"1\",\"godot_version\":\"4.3\",\"cost\":\"MIT\","
+				"\"modify_date\":\"{}\",\"category\":\"Tools\"}}",
+				(result.empty()) ? "" : ",", a.id, a.title, a.modify_date
+			);
+		}
+		std::string body = std::format(
+			"{{\"result\":[{}],\"page\":{},\"pages\":{},\"page_length\":{},\"total_items\":{}}}",
+			result, page, (listed.size() + page_length - 1) / page_length, page_length, listed.size()
+		);
+		if(after_page)
+			after_page(page);
+		return test_server::make_response("200 OK", "Content-Type: application/json\r\n", body);
+	}
+};
 
 
 TEST_SUITE("Caching functions"){
@@ -14,6 +167,474 @@ TEST_SUITE("Caching functions"){
 	TEST_CASE("Test cache database functions"){
 		gdpm::cache::create_package_database();
 	}
+
+	TEST_CASE("Test cache database reuses prepared statements"){
+		using namespace gdpm;
+		cache::database& db = cache::get_database();
+		string sql{"SELECT " GDPM_PACKAGE_CACHE_COLNAMES " FROM " GDPM_PACKAGE_CACHE_TABLENAME " WHERE title=?;"};
+		result_t r_first = db.prepare(sql);
+		result_t r_second = db.prepare(sql);
+		CHECK(!r_first.get_error().has_occurred());
+		CHECK(r_first.unwrap_unsafe() == r_second.unwrap_unsafe());
+		CHECK(&db == &cache::get_database());
+	}
+
+	TEST_CASE("Test bulk insert with quoted text"){
+		using namespace gdpm;
+		cache::params params{ .cache_path = constants::TestPath + "/packages.db" };
+		package::info p{
+			.asset_id		= 1,
+			.title			= "Bob's \"Addon\"",
+			.author			= "O'Brien",
+			.description	= "It's a 'test'; DROP TABLE cache;--",
+		};
+		package::info p_copy = p;
+		p_copy.asset_id = 2;
+		CHECK(!cache::create_package_database(true, params).has_occurred());
+		result_t r_insert = cache::bulk_insert_package_info({p, p_copy}, params);
+		CHECK(!r_insert.get_error().has_occurred());
+		CHECK(r_insert.unwrap_unsafe().rows == 2);
+
+		result_t r_cache = cache::get_package_info_by_title({p.title}, params);
+		package::info_list p_cache = r_cache.unwrap_unsafe();
+		CHECK(p_cache.size() == 1);
+		CHECK(p_cache[0].description == p.description);
+	}
+
+	TEST_CASE("Test batched lookup keeps input order"){
+		using namespace gdpm;
+		cache::params params{ .cache_path = constants::TestPath + "/packages.db" };
+		package::info_list p_list;
+		for(size_t i = 0; i < 5; i++)
+			p_list.emplace_back(package::info{ .asset_id = i, .title = "Package " + std::to_string(i) });
+		CHECK(!cache::create_package_database(true, params).has_occurred());
+		CHECK(!cache::insert_package_info(p_list, params).has_occurred());
+
+		result_t r_cache = cache::get_package_info_by_title({"Package 3", "Missing", "Package 1"}, params);
+		package::info_list p_cache = r_cache.unwrap_unsafe();
+		CHECK(p_cache.size() == 2);
+		CHECK(p_cache[0].asset_id == 3);
+		CHECK(p_cache[1].asset_id == 1);
+	}
+
+	TEST_CASE("Test lookup returns one row per title"){
+		using namespace gdpm;
+		cache::params params{ .cache_path = constants::TestPath + "/packages.db" };
+		package::info p{ .asset_id = 1, .title = "Foo", .author = "alice", .remote_source = "origin" };
+		package::info p_other{ .asset_id = 2, .title = "Foo", .author = "bob", .remote_source = "origin" };
+		CHECK(!cache::create_package_database(true, params).has_occurred());
+		CHECK(!cache::insert_package_info({p, p_other}, params).has_occurred());
+
+		package::info_list p_cache = cache::get_package_info_by_title({"Foo", "Foo"}, params).unwrap_unsafe();
+		CHECK(p_cache.size() == 1);
+		CHECK(p_cache[0].asset_id == 1);
+
+		/* An installed package wins over one that was cached first */
+		p_other.is_installed = true;
+		CHECK(!cache::update_package_info({p_other}, params).has_occurred());
+		p_cache = cache::get_package_info_by_title({"Foo"}, params).unwrap_unsafe();
+		CHECK(p_cache.size() == 1);
+		CHECK(p_cache[0].asset_id == 2);
+	}
+
+	TEST_CASE("Test upsert keeps local install state"){
+		using namespace gdpm;
+		cache::params params{ .cache_path = constants::TestPath + "/packages.db" };
+		package::info p{ .asset_id = 1, .title = "Package", .modify_date = "1", .remote_source = "origin" };
+		CHECK(!cache::create_package_database(true, params).has_occurred());
+		CHECK(!cache::upsert_package_info({p}, params).get_error().has_occurred());
+
+		package::info p_installed = p;
+		p_installed.is_installed	= true;
+		p_installed.install_path	= "addons/package";
+		CHECK(!cache::update_package_info({p_installed}, params).has_occurred());
+
+		p.version = "2.0";
+		result_t r_upsert = cache::upsert_package_info({p}, params);
+		CHECK(r_upsert.unwrap_unsafe().changed == 1);
+
+		package::info_list p_cache = cache::get_package_info_by_id({1}, params).unwrap_unsafe();
+		CHECK(p_cache.size() == 1);
+		CHECK(p_cache[0].version == "2.0");
+		CHECK(p_cache[0].is_installed);
+		CHECK(p_cache[0].install_path == "addons/package");
+	}
+
+	TEST_CASE("Test short staged sync does not prune the cache"){
+		using namespace gdpm;
+		cache::params params{ .cache_path = constants::TestPath + "/packages.db" };
+		package::info_list p_list;
+		for(size_t i = 0; i < 4; i++)
+			p_list.emplace_back(package::info{ .asset_id = i, .title = "Package " + std::to_string(i), .remote_source = "origin" });
+		CHECK(!cache::create_package_database(true, params).has_occurred());
+		CHECK(!cache::upsert_package_info(p_list, params).get_error().has_occurred());
+
+		/* Only the first page was staged out of the four packages */
+		CHECK(!cache::stage_package_info({p_list[0]}, params).get_error().has_occurred());
+		result_t r_swap = cache::swap_staged_packages("origin", p_list.size(), params);
+		CHECK(r_swap.get_error().has_occurred());
+		CHECK(cache::get_package_info_by_id({0, 1, 2, 3}, params).unwrap_unsafe().size() == 4);
+
+		/* A complete staging table is swapped in. Only the swap knows which
+		of the staged rows changed. */
+		package::info p_renamed = p_list[1];
+		p_renamed.title = "Package 1 renamed";
+		CHECK(!cache::clear_staged_packages("origin", params).has_occurred());
+		result_t r_stage = cache::stage_package_info({p_list[0], p_renamed}, params);
+		CHECK(!r_stage.get_error().has_occurred());
+		CHECK(r_stage.unwrap_unsafe().rows == 2);
+		CHECK(r_stage.unwrap_unsafe().changed == 0);
+		r_swap = cache::swap_staged_packages("origin", 2, params);
+		CHECK(!r_swap.get_error().has_occurred());
+		CHECK(r_swap.unwrap_unsafe().rows == 2);
+		CHECK(r_swap.unwrap_unsafe().changed == 1);
+		CHECK(r_swap.unwrap_unsafe().removed == 2);
+	}
+
+	TEST_CASE("Test insert keeps local install state"){
+		using namespace gdpm;
+		cache::params params{ .cache_path = constants::TestPath + "/packages.db" };
+		package::info p{ .asset_id = 1, .title = "Package", .remote_source = "origin" };
+		CHECK(!cache::create_package_database(true, params).has_occurred());
+		CHECK(!cache::insert_package_info({p}, params).has_occurred());
+
+		package::info p_installed = p;
+		p_installed.is_installed	= true;
+		p_installed.install_path	= "addons/package";
+		CHECK(!cache::update_package_info({p_installed}, params).has_occurred());
+		CHECK(!cache::bulk_insert_package_info({p}, params).get_error().has_occurred());
+
+		package::info_list p_cache = cache::get_package_info_by_id({1}, params).unwrap_unsafe();
+		CHECK(p_cache.size() == 1);
+		CHECK(p_cache[0].is_installed);
+		CHECK(p_cache[0].install_path == "addons/package");
+	}
+
+	TEST_CASE("Test offline full-text search"){
+		using namespace gdpm;
+		cache::params params{ .cache_path = constants::TestPath + "/packages.db" };
+		package::info p{
+			.asset_id		= 1,
+			.title			= "Godot Jolt",
+			.author			= "mihe",
+			.description	= "Jolt physics integration",
+			.category		= "Scripts",
+		};
+		package::info p_other = p;
+		p_other.asset_id	= 2;
+		p_other.title		= "Physics helpers";
+		p_other.description	= "Works well with jolt";
+		CHECK(!cache::create_package_database(true, params).has_occurred());
+		CHECK(!cache::insert_package_info({p_other, p}, params).has_occurred());
+
+		/* Title matches should rank first */
+		result_t r_search = cache::search_package_info("jol", 0, params);
+		CHECK(!r_search.get_error().has_occurred());
+		package::info_list p_found = r_search.unwrap_unsafe();
+		CHECK(p_found.size() == 2);
+		CHECK(p_found[0].title == p.title);
+	}
+
+	TEST_CASE("Test cache reader pool"){
+		using namespace gdpm;
+		cache::params params{ .cache_path = constants::TestPath + "/packages.db" };
+		cache::database& db = cache::get_database(params);
+		result_t r_reader = db.acquire_reader();
+		CHECK(!r_reader.get_error().has_occurred());
+		std::shared_ptr<cache::database> reader = r_reader.unwrap_unsafe();
+		CHECK(reader->is_read_only());
+
+		/* Released readers should be handed out again */
+		cache::database *ptr = reader.get();
+		reader.reset();
+		CHECK(db.acquire_reader().unwrap_unsafe().get() == ptr);
+
+		/* A reader can outlive the database it came from */
+		reader = db.acquire_reader().unwrap_unsafe();
+		cache::close_databases();
+		CHECK(reader->is_read_only());
+		reader.reset();
+	}
+
+	TEST_CASE("Test cache schema migrations"){
+		using namespace gdpm;
+		cache::params params{ .cache_path = constants::TestPath + "/packages.db" };
+		CHECK(!cache::create_package_database(true, params).has_occurred());
+		result_t r_version = cache::get_schema_version(params);
+		CHECK(!r_version.get_error().has_occurred());
+		int version = r_version.unwrap_unsafe();
+		CHECK(version > 0);
+
+		/* Migrating again should be a no-op */
+		CHECK(!cache::migrate(params).has_occurred());
+		CHECK(cache::get_schema_version(params).unwrap_unsafe() == version);
+	}
+}
+
+
+TEST_SUITE("Sync functions"){
+	TEST_CASE("Test page counts of asset lists"){
+		using namespace gdpm;
+		const std::vector<std::pair<string, int>> cases{
+			{R"({"pages": 3, "page_length": 10, "total_items": 101})",	3},
+			{R"({"page_length": 10, "total_items": 101})",				11},
+			{R"({"page_length": 10, "total_items": 100})",				10},
+			{R"({"page_length": 10, "total_items": 0})",				0},
+			{R"({"page_length": 0, "total_items": 5})",					5},
+		};
+		for(const auto& [json, pages] : cases){
+			CAPTURE(json);
+			rapidjson::Document doc;
+			doc.Parse(json.c_str());
+			CHECK(package::_get_page_count(doc) == pages);
+		}
+	}
+
+	TEST_CASE("Test concurrent paging only checkpoints staged pages"){
+		using namespace gdpm;
+		test_asset_library library;
+		for(int i = 0; i < 10; i++)
+			library.assets.push_back({900000 + i, std::format("Asset{}", i), "2024-01-01 00:00:00"});
+		library.failing_pages = {3};
+
+		config::context config{};
+		config.jobs = 4;
+		const string url = library.host() + rest_api::endpoints::GET_Asset;
+		rest_api::request_params rest_api_params = rest_api::make_from_config(config);
+		std::set<int> stored;
+		auto store_page = [&stored](const rapidjson::Document& doc){
+			stored.insert(doc["page"].GetInt());
+			return error();
+		};
+
+		/* Pages after the failed one are staged, but the checkpoint has to
+		stop before it so resuming fetches it again. */
+		cache::sync_state state{ .remote_source = url };
+		state.checkpoint.page = 0;
+		error error = package::_fetch_pages(config, url, rest_api_params, 1, 5, store_page, state);
+		CHECK(error.get_code() == ec::EMPTY_RESPONSE);
+		CHECK(stored == std::set<int>{1, 2, 4});
+		CHECK(state.checkpoint.page == 2);
+
+		{
+			std::lock_guard lock(library.mutex);
+			library.failing_pages.clear();
+		}
+		stored.clear();
+		error = package::_fetch_pages(config, url, rest_api_params, state.checkpoint.page + 1, 5, store_page, state);
+		CHECK(!error.has_occurred());
+		CHECK(stored == std::set<int>{3, 4});
+		CHECK(state.checkpoint.page == 4);
+	}
+
+	TEST_CASE("Test full sync survives the catalog changing while paging"){
+		using namespace gdpm;
+		test_asset_library library;
+		for(int i = 0; i < 6; i++)
+			library.assets.push_back({900100 + i, std::format("Shifted{}", i), "2024-01-01 00:00:00"});
+
+		/* A new asset shows up first right after the first page was read,
+		so the pages after it shift by one. */
+		bool is_shifted = false;
+		library.after_page = [&](int page){
+			if(page != 0 || is_shifted)
+				return;
+			library.assets.insert(library.assets.begin(), {900199, "ShiftedNew", "2024-02-01 00:00:00"});
+			is_shifted = true;
+		};
+
+		config::context config{};
+		config.remote_sources = {{"test", library.host()}};
+		package::params params;
+		params.remote_source = "test";
+		params.sync_method = package::SYNC_FULL;
+		CHECK(!cache::initialize().has_occurred());
+		for(int jobs : {1, 4}){
+			CAPTURE(jobs);
+			config.jobs = jobs;
+			{
+				std::lock_guard lock(library.mutex);
+				is_shifted = false;
+				library.assets.erase(library.assets.begin(), library.assets.end() - 6);
+			}
+			result_t r_fetch = package::fetch(config, {"ShiftedNew", "Shifted5"}, params);
+			CHECK(!r_fetch.get_error().has_occurred());
+			CHECK(r_fetch.unwrap_unsafe().size() == 2);
+		}
+
+		/* Syncing an empty catalog removes the test assets again */
+		{
+			std::lock_guard lock(library.mutex);
+			library.assets.clear();
+		}
+		CHECK(!package::fetch(config, {}, params).get_error().has_occurred());
+	}
+
+	TEST_CASE("Test sync freshness follows the TTL"){
+		using namespace gdpm;
+		test_asset_library library;
+		config::context config{};
+		config.remote_sources = {{"test", library.host()}};
+		config.sync_ttl = 3600;
+		package::params params;
+		params.remote_source = "test";
+		params.sync_method = package::SYNC_FULL;
+		CHECK(!cache::initialize().has_occurred());
+
+		/* Never synced, then synced just now */
+		CHECK(!package::is_sync_fresh(config, params));
+		CHECK(!package::fetch(config, {}, params).get_error().has_occurred());
+		CHECK(package::is_sync_fresh(config, params));
+
+		/* A TTL of 0 or --sync always syncs */
+		config.sync_ttl = 0;
+		CHECK(!package::is_sync_fresh(config, params));
+		config.sync_ttl = 3600;
+		config.force_sync = true;
+		CHECK(!package::is_sync_fresh(config, params));
+
+		/* Other remotes have their own sync state */
+		config.force_sync = false;
+		config.remote_sources.insert({"other", library.host() + "/other"});
+		CHECK(!package::is_sync_fresh(config, package::params{ .remote_source = "other" }));
+	}
+
+	TEST_CASE("Test targeted sync only keeps exact title matches"){
+		using namespace gdpm;
+		test_asset_library library;
+		library.assets.push_back({900301, "Targeted", "2024-01-01 00:00:00"});
+		library.assets.push_back({900302, "TargetedPlus", "2024-01-02 00:00:00"});
+		library.assets.push_back({900303, "Other", "2024-01-03 00:00:00"});
+
+		config::context config{};
+		config.jobs = 2;
+		config.remote_sources = {{"test", library.host()}};
+		package::params params;
+		params.remote_source = "test";
+		params.sync_method = package::SYNC_TARGETED;
+		CHECK(!cache::initialize().has_occurred());
+
+		/* The filter matches both titles, but only the asked for one is kept */
+		result_t r_fetch = package::fetch(config, {"Targeted"}, params);
+		CHECK(!r_fetch.get_error().has_occurred());
+		REQUIRE(r_fetch.unwrap_unsafe().size() == 1);
+		CHECK(r_fetch.unwrap_unsafe()[0].asset_id == 900301);
+		CHECK(cache::get_package_info_by_title({"TargetedPlus", "Other"}).unwrap_unsafe().empty());
+		CHECK(library.queries.size() == 1);
+
+		/* It never saw the whole catalog, so the sync state stays as is */
+		const string url = library.host() + rest_api::endpoints::GET_Asset;
+		cache::sync_state state = cache::get_sync_state(url).unwrap_unsafe();
+		CHECK(state.newest_modify_date.empty());
+		CHECK(state.last_synced == 0);
+		CHECK(!package::is_sync_fresh(config, params));
+
+		{
+			std::lock_guard lock(library.mutex);
+			library.assets.clear();
+		}
+		params.sync_method = package::SYNC_FULL;
+		CHECK(!package::fetch(config, {}, params).get_error().has_occurred());
+	}
+
+	TEST_CASE("Test interrupted full sync resumes from its checkpoint"){
+		using namespace gdpm;
+		test_asset_library library;
+		for(int i = 0; i < 10; i++)
+			library.assets.push_back({900400 + i, std::format("Resumed{}", i), "2024-01-01 00:00:00"});
+
+		config::context config{};
+		config.jobs = 1;
+		config.remote_sources = {{"test", library.host()}};
+		package::params params;
+		params.remote_source = "test";
+		params.sync_method = package::SYNC_FULL;
+		const string url = library.host() + rest_api::endpoints::GET_Asset;
+		CHECK(!cache::initialize().has_occurred());
+
+		auto fail_at_page_3 = [&](){
+			{
+				std::lock_guard lock(library.mutex);
+				library.failing_pages = {3};
+			}
+			CHECK(package::fetch(config, {}, params).get_error().has_occurred());
+			cache::sync_state state = cache::get_sync_state(url).unwrap_unsafe();
+			CHECK(state.checkpoint.page == 2);
+			std::lock_guard lock(library.mutex);
+			library.failing_pages.clear();
+			library.queries.clear();
+		};
+
+		/* The next run picks up at the page that failed */
+		fail_at_page_3();
+		result_t r_fetch = package::fetch(config, {"Resumed0", "Resumed9"}, params);
+		CHECK(!r_fetch.get_error().has_occurred());
+		CHECK(r_fetch.unwrap_unsafe().size() == 2);
+		REQUIRE(library.queries.size() == 2);
+		CHECK(test_asset_library::get_param(library.queries[0], "page") == "3");
+		CHECK(!cache::get_sync_state(url).unwrap_unsafe().checkpoint.is_set());
+
+		/* Pages have moved if the catalog changed meanwhile, so it starts over */
+		fail_at_page_3();
+		{
+			std::lock_guard lock(library.mutex);
+			library.assets.push_back({900410, "Resumed10", "2024-01-01 00:00:00"});
+		}
+		r_fetch = package::fetch(config, {"Resumed10"}, params);
+		CHECK(!r_fetch.get_error().has_occurred());
+		CHECK(r_fetch.unwrap_unsafe().size() == 1);
+		REQUIRE(library.queries.size() > 1);
+		CHECK(test_asset_library::get_param(library.queries[0], "page") == "3");
+		CHECK(test_asset_library::get_param(library.queries[1], "page").empty());
+
+		{
+			std::lock_guard lock(library.mutex);
+			library.assets.clear();
+		}
+		CHECK(!package::fetch(config, {}, params).get_error().has_occurred());
+	}
+
+	TEST_CASE("Test delta sync stops at the high-water mark"){
+		using namespace gdpm;
+		test_asset_library library;
+		for(int i = 1; i <= 6; i++)
+			library.assets.push_back({900200 + i, std::format("Delta{}", i), std::format("2024-01-0{} 00:00:00", i)});
+
+		config::context config{};
+		config.jobs = 1;
+		config.remote_sources = {{"test", library.host()}};
+		package::params params;
+		params.remote_source = "test";
+		params.sync_method = package::SYNC_FULL;
+		CHECK(!cache::initialize().has_occurred());
+		CHECK(!package::fetch(config, {}, params).get_error().has_occurred());
+
+		/* Only the first two pages, newest first, hold anything past the
+		mark, so the delta sync shouldn't ask for more. */
+		{
+			std::lock_guard lock(library.mutex);
+			library.assets.push_back({900207, "Delta7", "2024-02-01 00:00:00"});
+			library.assets.push_back({900208, "Delta8", "2024-02-02 00:00:00"});
+			library.queries.clear();
+		}
+		params.sync_method = package::SYNC_DELTA;
+		result_t r_fetch = package::fetch(config, {"Delta7", "Delta8"}, params);
+		CHECK(!r_fetch.get_error().has_occurred());
+		CHECK(r_fetch.unwrap_unsafe().size() == 2);
+		REQUIRE(library.queries.size() == 2);
+		CHECK(library.queries[0].find("sort=updated") != string::npos);
+		CHECK(test_asset_library::get_param(library.queries[1], "page") == "1");
+
+		result_t r_state = cache::get_sync_state(library.host() + rest_api::endpoints::GET_Asset);
+		CHECK(r_state.unwrap_unsafe().newest_modify_date == "2024-02-02 00:00:00");
+
+		{
+			std::lock_guard lock(library.mutex);
+			library.assets.clear();
+		}
+		params.sync_method = package::SYNC_FULL;
+		CHECK(!package::fetch(config, {}, params).get_error().has_occurred());
+	}
 }
 
 
@@ -84,4 +705,611 @@ TEST_CASE("Test configuration functions"){
 
 	error error_load = config::load(config.path, config);
 	CHECK((int)error_load.get_code() == 0);
-}
\ No newline at end of file
+}
+
+
+TEST_CASE("Test event loop tasks"){
+	using namespace gdpm;
+	using namespace std::chrono_literals;
+
+	http::loop loop;
+	std::vector<int> finished;
+	auto wait = [&loop, &finished](int ms) -> task<int> {
+		co_await loop.sleep_for(std::chrono::milliseconds(ms));
+		finished.emplace_back(ms);
+		co_return ms;
+	};
+	auto sum = [&wait]() -> task<int> {
+		int a = co_await wait(20);
+		int b = co_await wait(10);
+		co_return a + b;
+	};
+
+	auto late = [&wait]() -> task<> { co_await wait(50); };
+
+	/* Spawned tasks run alongside, so the shorter sleeps finish first */
+	loop.spawn(late());
+	CHECK(loop.run(sum()) == 30);
+	CHECK(!loop.run().has_occurred());
+	CHECK(finished == std::vector<int>{20, 10, 50});
+
+	auto answer = [](){ return 42; };
+	auto offloaded = [&loop, &answer]() -> task<int> { co_return co_await loop.offload(answer); };
+	CHECK(loop.run(offloaded()) == 42);
+
+	/* Exceptions thrown by offloaded work reach the awaiting task */
+	auto fail = []() -> int { throw std::runtime_error("offload failed"); };
+	auto failed = [&loop, &fail]() -> task<int> { co_return co_await loop.offload(fail); };
+	CHECK_THROWS_AS(loop.run(failed()), std::runtime_error);
+
+	/* A task that nothing will resume never has a result to return */
+	auto stuck = []() -> task<int> { co_await std::suspend_always{}; co_return 0; };
+	CHECK_THROWS_AS(loop.run(stuck()), std::runtime_error);
+	loop.spawn([]() -> task<> { co_await std::suspend_always{}; }());
+	CHECK(loop.run().has_occurred());
+}
+
+
+TEST_SUITE("HTTP functions"){
+
+	TEST_CASE("Test SHA-256 of files against FIPS 180 vectors"){
+		using namespace gdpm;
+		namespace fs = std::filesystem;
+		fs::create_directories(constants::TestPath);
+		auto hash_of = [](const string& contents){
+			string path = constants::TestPath + "/sha256.bin";
+			{
+				std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+				ofs.write(contents.data(), contents.size());
+			}
+			return utils::sha256_file(path);
+		};
+		CHECK(hash_of("") == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+		CHECK(hash_of("abc") == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+		CHECK(hash_of("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq") == "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+		CHECK(hash_of(string(1000000, 'a')) == "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+	}
+
+	TEST_CASE("Test Content-Range totals"){
+		using namespace gdpm;
+		const std::vector<std::pair<string, curl_off_t>> cases{
+			{"bytes 0-99/1000",		1000},
+			{"bytes 500-999/1000",	1000},
+			{"Bytes */1000",		1000},
+			{"bytes 0-99/*",		-1},
+			{"bytes 0-99/12x",		-1},
+			{"bytes 0-99/",			-1},
+			{"items 0-99/1000",		-1},
+			{"garbage",				-1},
+		};
+		for(const auto& [value, total] : cases){
+			CAPTURE(value);
+			CHECK(http::_get_range_total({{"content-range", value}}) == total);
+		}
+		CHECK(http::_get_range_total({}) == -1);
+	}
+
+	TEST_CASE("Test retry policy"){
+		using namespace gdpm;
+		http::retry_policy policy;
+		const std::vector<std::tuple<long, CURLcode, bool>> cases{
+			{http::INTERNAL_SERVER_ERROR,		CURLE_OK,					true},
+			{http::BAD_GATEWAY,					CURLE_OK,					true},
+			{http::SERVICE_UNAVAILABLE,			CURLE_OK,					true},
+			{http::NOT_IMPLEMENTED,				CURLE_OK,					false},
+			{http::HTTP_VERSION_NOT_SUPPORTED,	CURLE_OK,					false},
+			{http::REQUEST_TIMEOUT,				CURLE_OK,					true},
+			{http::NOT_FOUND,					CURLE_OK,					false},
+			{http::OK,							CURLE_OK,					false},
+			{0,									CURLE_OPERATION_TIMEDOUT,	true},
+			{0,									CURLE_COULDNT_CONNECT,		true},
+			{0,									CURLE_PARTIAL_FILE,			true},
+			{0,									CURLE_URL_MALFORMAT,		false},
+		};
+		for(const auto& [code, result, expected] : cases){
+			CAPTURE(code);
+			CAPTURE(result);
+			CHECK(policy.should_retry(code, result) == expected);
+		}
+
+		policy.retry_transport_errors = false;
+		CHECK(!policy.should_retry(0, CURLE_OPERATION_TIMEDOUT));
+		CHECK(policy.should_retry(http::BAD_GATEWAY, CURLE_OK));
+		policy.retry_server_errors = false;
+		CHECK(!policy.should_retry(http::BAD_GATEWAY, CURLE_OK));
+		CHECK(policy.should_retry(http::REQUEST_TIMEOUT, CURLE_OK));
+		policy.retry_codes.clear();
+		CHECK(!policy.should_retry(http::REQUEST_TIMEOUT, CURLE_OK));
+	}
+
+	TEST_CASE("Test retry delays"){
+		using namespace gdpm;
+		using namespace std::chrono_literals;
+		http::retry_policy policy;
+		policy.base_delay	= 100ms;
+		policy.max_delay	= 1000ms;
+
+		/* Without jitter the delay doubles exactly up to the cap */
+		policy.jitter = 0.0;
+		const std::vector<std::pair<int, std::chrono::milliseconds>> cases{
+			{0, 100ms}, {1, 100ms}, {2, 200ms}, {3, 400ms}, {4, 800ms}, {5, 1000ms}, {64, 1000ms},
+		};
+		for(const auto& [attempt, delay] : cases){
+			CAPTURE(attempt);
+			CHECK(policy.get_delay(attempt) == delay);
+		}
+
+		/* With jitter it stays within the jittered fraction below it */
+		policy.jitter = 0.5;
+		for(const auto& [attempt, delay] : cases){
+			CAPTURE(attempt);
+			for(int i = 0; i < 20; ++i){
+				auto jittered = policy.get_delay(attempt);
+				CHECK(jittered >= delay / 2);
+				CHECK(jittered <= delay);
+			}
+		}
+	}
+
+	TEST_CASE("Test response buffers grow geometrically"){
+		using namespace gdpm;
+		/* 4 MiB in 1 KiB chunks should take a few dozen allocations at most */
+		string chunk(1024, 'x');
+		const size_t chunks = 4096;
+
+		utils::memory_buffer m = utils::make_buffer();
+		size_t reallocs = 0;
+		for(size_t i = 0; i < chunks; ++i){
+			size_t capacity = m.capacity;
+			REQUIRE(http::write_to_buffer(chunk.data(), 1, chunk.size(), &m) == chunk.size());
+			reallocs += (m.capacity != capacity);
+		}
+		CHECK(m.size == chunks * chunk.size());
+		CHECK(m.addr[m.size] == '\0');
+		CHECK(reallocs <= 16);
+		utils::free_buffer(m);
+
+		/* Without a Content-Length the body starts at one curl write */
+		string body;
+		CURL *eh = curl_easy_init();
+		http::_body_sink sink{ .body = &body, .eh = eh };
+		reallocs = 0;
+		for(size_t i = 0; i < chunks; ++i){
+			size_t capacity = body.capacity();
+			REQUIRE(http::_write_to_body(chunk.data(), 1, chunk.size(), &sink) == chunk.size());
+			reallocs += (body.capacity() != capacity);
+		}
+		curl_easy_cleanup(eh);
+		CHECK(body.size() == chunks * chunk.size());
+		CHECK(reallocs <= 16);
+	}
+
+	TEST_CASE("Test Retry-After delays"){
+		using namespace gdpm;
+		/* An HTTP date half a minute from now */
+		char date[64];
+		std::time_t later = std::time(nullptr) + 30;
+		std::strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", std::gmtime(&later));
+
+		const std::vector<std::tuple<string, int, long>> cases{
+			{"0",								1,	0},
+			{"17",								1,	17},
+			{"86400",							1,	GDPM_HTTP_MAX_RETRY_AFTER_S},
+			{"99999999999999999999999",			1,	GDPM_HTTP_MAX_RETRY_AFTER_S},
+			{"Wed, 21 Oct 2015 07:28:00 GMT",	1,	0},
+			{"soon",							1,	1},
+			{"soon",							3,	4},
+			{"",								0,	1},
+		};
+		for(const auto& [value, attempt, seconds] : cases){
+			CAPTURE(value);
+			CAPTURE(attempt);
+			CHECK(http::_get_retry_after({{"retry-after", value}}, attempt) == seconds);
+		}
+		long seconds = http::_get_retry_after({{"retry-after", date}}, 1);
+		CHECK(seconds >= 28);
+		CHECK(seconds <= 30);
+
+		/* Without the header, back off exponentially up to the cap */
+		CHECK(http::_get_retry_after({}, 1) == 1);
+		CHECK(http::_get_retry_after({}, 2) == 2);
+		CHECK(http::_get_retry_after({}, 7) == 64);
+		CHECK(http::_get_retry_after({}, 30) == 64);
+	}
+
+	TEST_CASE("Test host rate limit token bucket"){
+		using namespace gdpm;
+		using namespace std::chrono_literals;
+		http::settings settings;
+		settings.max_host_rate = 2;
+		http::initialize(settings);
+
+		/* A second's worth of requests go at once, then one every 500ms */
+		CHECK(http::_acquire_host("bucket.test") == 0ms);
+		CHECK(http::_acquire_host("bucket.test") == 0ms);
+		auto wait = http::_acquire_host("bucket.test");
+		CHECK(wait > 0ms);
+		CHECK(wait <= 500ms);
+		CHECK(http::_acquire_host("other.bucket.test") == 0ms);
+
+		http::initialize(http::settings());
+	}
+
+	TEST_CASE("Test transfer window"){
+		using namespace gdpm;
+		using namespace std::chrono_literals;
+		/* Each finished transfer is 100 bytes and takes a second */
+		auto now = std::chrono::steady_clock::now();
+		auto finish = [&now](http::transfer_window& w, bool is_congested, curl_off_t bytes = 100){
+			now += 1s;
+			w.update(is_congested, bytes, now);
+		};
+
+		SUBCASE("slow start grows by one per transfer up to the limit"){
+			http::transfer_window w(4);
+			CHECK(w.get_limit() == 1);
+			finish(w, false);
+			CHECK(w.get_limit() == 2);
+			finish(w, false);
+			CHECK(w.get_limit() == 3);
+			finish(w, false);
+			CHECK(w.get_limit() == 4);
+			finish(w, false);
+			CHECK(w.get_limit() == 4);
+		}
+
+		SUBCASE("congestion halves the window once per round"){
+			http::transfer_window w(4);
+			for(int i = 0; i < 4; ++i)
+				finish(w, false);
+			REQUIRE(w.get_limit() == 4);
+			finish(w, true);
+			CHECK(w.get_limit() == 2);
+			finish(w, true);
+			CHECK(w.get_limit() == 2);
+
+			/* Above the threshold it only grows by one per round */
+			finish(w, false);
+			CHECK(w.get_limit() == 2);
+			finish(w, false);
+			CHECK(w.get_limit() == 2);
+			finish(w, false);
+			CHECK(w.get_limit() == 3);
+		}
+
+		SUBCASE("a round with less throughput settles one below"){
+			http::transfer_window w(4);
+			for(int i = 0; i < 4; ++i)
+				finish(w, false);
+			REQUIRE(w.get_limit() == 4);
+			for(int i = 0; i < 3; ++i)
+				finish(w, false, 10);
+			CHECK(w.get_limit() == 4);
+			finish(w, false, 10);
+			CHECK(w.get_limit() == 3);
+		}
+
+		SUBCASE("a single transfer limit never grows"){
+			http::transfer_window w(1);
+			for(int i = 0; i < 4; ++i){
+				finish(w, i % 2 == 0);
+				CHECK(w.get_limit() == 1);
+			}
+			w.set_max_transfers(0);
+			CHECK(w.get_limit() == 1);
+		}
+	}
+
+	TEST_CASE("Test concurrent requests keep input order"){
+		using namespace gdpm;
+		namespace fs = std::filesystem;
+		/* Local files stand in for a server, largest first */
+		const fs::path dir = fs::absolute(constants::TestPath + "/requests");
+		fs::create_directories(dir);
+		string_list urls;
+		for(size_t i = 0; i < 4; ++i){
+			const fs::path path = dir / std::format("{}.txt", i);
+			std::ofstream(path, std::ios::binary) << string((4 - i) * 50000, 'a' + i);
+			urls.emplace_back("file://" + path.string());
+		}
+		urls.emplace_back("file://" + (dir / "missing.txt").string());
+
+		http::context http(2);
+		http::responses responses = http.requests(urls);
+		REQUIRE(responses.size() == urls.size());
+		for(size_t i = 0; i < 4; ++i){
+			CAPTURE(i);
+			CHECK(responses[i].body == string((4 - i) * 50000, 'a' + i));
+		}
+		CHECK(responses[4].body.empty());
+	}
+
+	TEST_CASE("Test responses report their transfer sizes"){
+		using namespace gdpm;
+		namespace fs = std::filesystem;
+		CHECK(http::request().compress);
+
+		/* Nothing is encoded over file://, so both sizes match the body */
+		const fs::path path = fs::absolute(constants::TestPath + "/requests/sizes.txt");
+		fs::create_directories(path.parent_path());
+		std::ofstream(path, std::ios::binary) << string(12345, 'x');
+		http::context http;
+		http::responses responses = http.requests({"file://" + path.string()});
+		REQUIRE(responses.size() == 1);
+		CHECK(responses[0].bytes_received == 12345);
+		CHECK(responses[0].bytes_decoded == 12345);
+
+		/* The same body compressed, only sent to clients that accept it */
+		const std::vector<std::pair<string, string>> encodings{
+			{"gzip", string("\x1f\x8b\x08\x00\x00\x00\x00\x00\x02\x03\xed\xc1\x01\x0d\x00\x00\x00\xc2\xa0\xda\x8f\x6f\x0f\x07\x14\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x70\x6b\x40\x25\xef\x90\x39\x30\x00\x00", 46)},
+			{"deflate", string("\x78\x9c\xed\xc1\x01\x0d\x00\x00\x00\xc2\xa0\xda\x8f\x6f\x0f\x07\x14\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x70\x6b\xe8\xe1\x9c\x03", 34)},
+		};
+		for(const auto& [encoding, compressed] : encodings){
+			CAPTURE(encoding);
+			test_server server([&](const string& request){
+				if(test_server::get_header(request, "Accept-Encoding").find(encoding) == string::npos)
+					return test_server::make_response("200 OK", "", string(12345, 'x'));
+				return test_server::make_response("200 OK", std::format("Content-Encoding: {}\r\n", encoding), compressed);
+			});
+			http::response r = http.request(server.url("/"));
+			CHECK(r.body == string(12345, 'x'));
+			CHECK(r.bytes_received == (curl_off_t)compressed.size());
+			CHECK(r.bytes_decoded == 12345);
+
+			http::request params;
+			params.compress = false;
+			r = http.request(server.url("/"), params);
+			CHECK(r.bytes_received == 12345);
+			CHECK(r.bytes_decoded == 12345);
+		}
+	}
+
+	TEST_CASE("Test segmented downloads resume only their failed ranges"){
+		using namespace gdpm;
+		namespace fs = std::filesystem;
+		http::settings settings;
+		settings.max_segments		= 4;
+		settings.min_segment_size	= 1024;
+		http::initialize(settings);
+
+		string body(4096, '\0');
+		for(size_t i = 0; i < body.size(); i++)
+			body[i] = (char)(i * 31 % 251);
+		std::mutex mutex;
+		string_list ranges;
+		string etag = "\"v1\"";
+		bool is_failing = true;
+		test_server server([&](const string& request){
+			std::lock_guard lock(mutex);
+			string headers = std::format("Accept-Ranges: bytes\r\nETag: {}\r\n", etag);
+			if(request.starts_with("HEAD "))
+				return test_server::make_response("200 OK", headers, body, false);
+			string range = test_server::get_header(request, "Range").substr(6);
+			size_t dash = range.find('-');
+			size_t begin = std::stoul(range.substr(0, dash));
+			size_t end = std::stoul(range.substr(dash + 1));
+			ranges.emplace_back(range);
+			if(is_failing && begin == 2048)
+				return test_server::make_response("500 Internal Server Error", "");
+			return test_server::make_response("206 Partial Content", 
+				headers + std::format("Content-Range: bytes {}-{}/4096\r\n", begin, end),
+				body.substr(begin, end - begin + 1)
+			);
+		});
+
+		const fs::path path = fs::absolute(constants::TestPath + "/segments/file.bin");
+		fs::create_directories(path.parent_path());
+		fs::remove(path);
+		http::_remove_segments(path.string());
+		http::request params;
+		params.retry.max_attempts = 1;
+		auto download = [&](){
+			http::loop loop;
+			return loop.run(loop.download(server.url("/file.bin"), path.string(), params));
+		};
+
+		/* The failed range keeps what the others got for the next run */
+		CHECK(download().code != http::OK);
+		CHECK(ranges.size() == 4);
+		CHECK(!fs::exists(path));
+		CHECK(fs::exists(path.string() + ".segments"));
+		CHECK(fs::exists(path.string() + ".segments.state"));
+
+		is_failing = false;
+		ranges.clear();
+		CHECK(download().code == http::OK);
+		CHECK(ranges == string_list{"2048-3071"});
+		CHECK(!fs::exists(path.string() + ".segments"));
+		CHECK(!fs::exists(path.string() + ".segments.state"));
+		{
+			std::ifstream ifs(path, std::ios::binary);
+			CHECK(string(std::istreambuf_iterator<char>(ifs), {}) == body);
+		}
+
+		/* Segments saved for another version of the file start over */
+		fs::remove(path);
+		is_failing = true;
+		CHECK(download().code != http::OK);
+		etag = "\"v2\"";
+		is_failing = false;
+		ranges.clear();
+		CHECK(download().code == http::OK);
+		CHECK(ranges.size() == 4);
+
+		http::initialize(http::settings());
+	}
+
+	TEST_CASE("Test segment progress is saved and checked on load"){
+		using namespace gdpm;
+		http::_segments saved;
+		saved.path		= constants::TestPath + "/segments/state.test";
+		saved.length	= 100;
+		saved.validator	= "\"etag\"";
+		saved.list.resize(2);
+		saved.list[0].end		= 49;
+		saved.list[0].written	= 50;
+		saved.list[1].begin		= 50;
+		saved.list[1].end		= 99;
+		saved.list[1].written	= 10;
+		std::filesystem::create_directories(constants::TestPath + "/segments");
+		REQUIRE(http::_save_segments(saved));
+
+		http::_segments loaded{ .path = saved.path, .length = 100, .validator = "\"etag\"" };
+		REQUIRE(http::_load_segments(loaded));
+		REQUIRE(loaded.list.size() == 2);
+		CHECK(loaded.list[0].is_done);
+		CHECK(!loaded.list[1].is_done);
+		CHECK(loaded.list[1].begin == 50);
+		CHECK(loaded.list[1].written == 10);
+
+		/* Progress of another file is never picked up */
+		http::_segments other{ .path = saved.path, .length = 100, .validator = "\"other\"" };
+		CHECK(!http::_load_segments(other));
+		http::_segments shorter{ .path = saved.path, .length = 99, .validator = "\"etag\"" };
+		CHECK(!http::_load_segments(shorter));
+
+		/* Neither are segments that leave gaps */
+		saved.list[1].begin = 60;
+		REQUIRE(http::_save_segments(saved));
+		CHECK(!http::_load_segments(loaded));
+	}
+
+	TEST_CASE("Test pooled handles share DNS entries"){
+		using namespace gdpm;
+		test_server server([](const string&){ return test_server::make_response("200 OK", ""); });
+		const string url = std::format("http://share.test:{}/", server.port);
+		curl_slist *resolve = curl_slist_append(nullptr, std::format("share.test:{}:127.0.0.1", server.port).c_str());
+
+		/* Only the first handle is told where share.test is, so the other
+		can only find it in the shared DNS cache. */
+		CURL *first = http::acquire_handle();
+		CURL *second = http::acquire_handle();
+		REQUIRE(first != second);
+		curl_easy_setopt(first, CURLOPT_RESOLVE, resolve);
+		for(CURL *curl : {first, second}){
+			curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+			curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+			CHECK(curl_easy_perform(curl) == CURLE_OK);
+		}
+		CURL *unshared = curl_easy_init();
+		curl_easy_setopt(unshared, CURLOPT_URL, url.c_str());
+		curl_easy_setopt(unshared, CURLOPT_NOBODY, 1L);
+		CHECK(curl_easy_perform(unshared) == CURLE_COULDNT_RESOLVE_HOST);
+		curl_easy_cleanup(unshared);
+
+		/* Released handles are handed out again instead of new ones */
+		http::release_handle(second);
+		http::release_handle(first);
+		CHECK(http::acquire_handle() == first);
+		CHECK(http::acquire_handle() == second);
+		http::release_handle(second);
+		http::release_handle(first);
+		curl_slist_free_all(resolve);
+	}
+
+	TEST_CASE("Test HTTP/2 is only negotiated over TLS"){
+		using namespace gdpm;
+		std::mutex mutex;
+		string request;
+		test_server server([&](const string& r){
+			std::lock_guard lock(mutex);
+			request = r;
+			return test_server::make_response("200 OK", "");
+		});
+
+		/* Asking for HTTP/2 on plain HTTP would send an h2c upgrade on every
+		request, so pooled handles stay on HTTP/1.1 there. */
+		CURL *curl = http::acquire_handle();
+		curl_easy_setopt(curl, CURLOPT_URL, server.url("/").c_str());
+		curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+		CHECK(curl_easy_perform(curl) == CURLE_OK);
+		long version = 0;
+		curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &version);
+		CHECK(version == CURL_HTTP_VERSION_1_1);
+		std::lock_guard lock(mutex);
+		CHECK(request.find("Upgrade:") == string::npos);
+		http::release_handle(curl);
+	}
+
+	TEST_CASE("Test revalidated responses report the cached body size"){
+		using namespace gdpm;
+		namespace fs = std::filesystem;
+		http::settings settings;
+		settings.cache_dir = constants::TestPath + "/http-cache";
+		fs::remove_all(settings.cache_dir);
+		http::initialize(settings);
+
+		const string body = "cached body";
+		test_server server([&body](const string& request){
+			if(test_server::get_header(request, "If-None-Match") == "\"v1\"")
+				return test_server::make_response("304 Not Modified", "ETag: \"v1\"\r\n");
+			return test_server::make_response("200 OK", "ETag: \"v1\"\r\n", body);
+		});
+
+		/* The first request fills the cache and the rest revalidate it */
+		http::request params;
+		params.use_cache = true;
+		http::context http;
+		http::response r = http.request(server.url("/context"), params);
+		CHECK(!r.from_cache);
+		CHECK(r.bytes_decoded == (curl_off_t)body.size());
+		r = http.request(server.url("/context"), params);
+		CHECK(r.from_cache);
+		CHECK(r.code == http::OK);
+		CHECK(r.bytes_received == 0);
+		CHECK(r.bytes_decoded == (curl_off_t)body.size());
+
+		http::loop loop;
+		r = loop.run(loop.get(server.url("/loop"), params));
+		CHECK(!r.from_cache);
+		r = loop.run(loop.get(server.url("/loop"), params));
+		CHECK(r.from_cache);
+		CHECK(r.bytes_received == 0);
+		CHECK(r.bytes_decoded == (curl_off_t)body.size());
+
+		http::initialize(http::settings());
+	}
+
+	TEST_CASE("Test response cache evicts the least recently used entries"){
+		using namespace gdpm;
+		namespace fs = std::filesystem;
+		http::settings settings;
+		settings.cache_dir		= constants::TestPath + "/http-cache";
+		settings.cache_max_size	= 300;
+		fs::remove_all(settings.cache_dir);
+		http::initialize(settings);
+
+		auto make_response = [](const string& etag){
+			http::response r;
+			r.code = http::OK;
+			r.body = string(100, 'x');
+			r.headers.insert({"etag", etag});
+			return r;
+		};
+		http::_cache_entry entry;
+		http::_cache_store("http://a.test/", make_response("\"a\""));
+		http::_cache_store("http://b.test/", make_response("\"b\""));
+		CHECK(http::_cache_load("http://a.test/", entry));
+		CHECK(entry.etag == "\"a\"");
+		CHECK(entry.body.size() == 100);
+
+		/* A hit refreshes the write time, so b is now the oldest */
+		fs::last_write_time(http::_cache_path("http://a.test/"), fs::file_time_type::clock::now() + std::chrono::seconds(10));
+		http::_cache_store("http://c.test/", make_response("\"c\""));
+		CHECK(http::_cache_load("http://a.test/", entry));
+		CHECK(!http::_cache_load("http://b.test/", entry));
+		CHECK(http::_cache_load("http://c.test/", entry));
+
+		/* Responses the server doesn't want kept are never stored */
+		http::response r_private = make_response("\"d\"");
+		r_private.headers.insert({"cache-control", "private, max-age=60"});
+		http::_cache_store("http://d.test/", r_private);
+		http::response r_no_store = make_response("\"e\"");
+		r_no_store.headers.insert({"cache-control", "No-Store"});
+		http::_cache_store("http://e.test/", r_no_store);
+		CHECK(!http::_cache_load("http://d.test/", entry));
+		CHECK(!http::_cache_load("http://e.test/", entry));
+
+		http::initialize(http::settings());
+	}
+}